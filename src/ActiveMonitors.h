@@ -1,6 +1,7 @@
 #pragma once
 
 #include <unordered_map>
+#include <array>
 
 #include "golpe.h"
 
@@ -27,20 +28,17 @@ struct ActiveMonitors : NonCopyable {
         uint64_t latestEventId;
     };
 
+    // Only exact lookups are done, so these are hash maps. Tags are split by tag name so that a tag
+    // value can be looked up directly as a string_view (heterogeneous lookup), without building a
+    // key, and tags with a name no filter refers to are skipped without hashing.
     using MonitorSet = flat_hash_map<NostrFilter*, MonitorItem>;
-    btree_map<Bytes32, MonitorSet> allIds;
-    btree_map<Bytes32, MonitorSet> allAuthors;
-    btree_map<std::string, MonitorSet> allTags;
-    btree_map<uint64_t, MonitorSet> allKinds;
+    using TagMonitors = flat_hash_map<std::string, MonitorSet>;
+    flat_hash_map<Bytes32, MonitorSet> allIds;
+    flat_hash_map<Bytes32, MonitorSet> allAuthors;
+    std::array<TagMonitors, 256> allTags; // tagName -> tagVal -> MonitorSet
+    flat_hash_map<uint64_t, MonitorSet> allKinds;
     MonitorSet allOthers;
-
-    std::string tagSpecBuf = std::string(256, '\0');
-    const std::string &getTagSpec(uint8_t k, std::string_view val) {
-        tagSpecBuf.clear();
-        tagSpecBuf += (char)k;
-        tagSpecBuf += val;
-        return tagSpecBuf;
-    }
+    uint64_t numTagMonitors = 0; // number of entries in all of allTags
 
 
   public:
@@ -85,46 +83,44 @@ struct ActiveMonitors : NonCopyable {
         conns.erase(connId);
     }
 
-    void process(lmdb::txn &txn, defaultDb::environment::View_Event &ev, const std::function<void(RecipientList &&, uint64_t)> &cb) {
+    void process(uint64_t levId, PackedEventView packed, const std::function<void(RecipientList &&, uint64_t)> &cb) {
         RecipientList recipients;
 
         auto processMonitorSet = [&](MonitorSet &ms){
             for (auto &[f, item] : ms) {
-                if (item.latestEventId >= ev.primaryKeyId || item.mon->sub.latestEventId >= ev.primaryKeyId) continue;
-                item.latestEventId = ev.primaryKeyId;
+                if (item.latestEventId >= levId || item.mon->sub.latestEventId >= levId) continue;
+                item.latestEventId = levId;
 
-                if (f->doesMatch(PackedEventView(ev.buf))) {
+                if (f->doesMatch(packed)) {
                     recipients.emplace_back(item.mon->sub.connId, item.mon->sub.subId);
-                    item.mon->sub.latestEventId = ev.primaryKeyId;
+                    item.mon->sub.latestEventId = levId;
                     continue;
                 }
             }
         };
 
-        // Exact-key lookup only: installLookups keys monitors by id / author / tagSpec /
-        // kind string. Prior code used upper_bound + prev + equality predicate; with
-        // unique btree keys that is equivalent to find() without std::function per call.
-        auto lookupMonitors = [&]<typename T>(btree_map<T, MonitorSet> &m, const T &key) {
+        auto lookupMonitors = [&](auto &m, const auto &key) {
             auto it = m.find(key);
             if (it != m.end()) processMonitorSet(it->second);
         };
 
-        auto packed = PackedEventView(ev.buf);
-
         lookupMonitors(allIds, Bytes32(packed.id()));
         lookupMonitors(allAuthors, Bytes32(packed.pubkey()));
 
-        packed.foreachTag([&](char tagName, std::string_view tagVal){
-            lookupMonitors(allTags, getTagSpec(tagName, tagVal));
-            return true;
-        });
+        if (numTagMonitors) {
+            packed.foreachTag([&](char tagName, std::string_view tagVal){
+                auto &m = allTags[uint8_t(tagName)];
+                if (!m.empty()) lookupMonitors(m, tagVal);
+                return true;
+            });
+        }
 
         lookupMonitors(allKinds, packed.kind());
 
         processMonitorSet(allOthers);
 
         if (recipients.size()) {
-            cb(std::move(recipients), ev.primaryKeyId);
+            cb(std::move(recipients), levId);
         }
     }
 
@@ -154,9 +150,10 @@ struct ActiveMonitors : NonCopyable {
                 }
             } else if (f.tags.size()) {
                 for (const auto &[tagName, filterSet] : f.tags) {
+                    auto &tagMonitors = allTags[uint8_t(tagName)];
                     for (size_t i = 0; i < filterSet.size(); i++) {
-                        auto &tagSpec = getTagSpec(tagName, filterSet.at(i));
-                        auto res = allTags.try_emplace(tagSpec);
+                        auto res = tagMonitors.try_emplace(std::string(filterSet.at(i)));
+                        if (res.second) numTagMonitors++;
                         res.first->second.try_emplace(&f, MonitorItem{m, currEventId});
                     }
                 }
@@ -189,11 +186,15 @@ struct ActiveMonitors : NonCopyable {
                 }
             } else if (f.tags.size()) {
                 for (const auto &[tagName, filterSet] : f.tags) {
+                    auto &tagMonitors = allTags[uint8_t(tagName)];
                     for (size_t i = 0; i < filterSet.size(); i++) {
-                        auto &tagSpec = getTagSpec(tagName, filterSet.at(i));
-                        auto &monSet = allTags.at(tagSpec);
-                        monSet.erase(&f);
-                        if (monSet.empty()) allTags.erase(tagSpec);
+                        auto it = tagMonitors.find(filterSet.at(i));
+                        if (it == tagMonitors.end()) continue;
+                        it->second.erase(&f);
+                        if (it->second.empty()) {
+                            tagMonitors.erase(it);
+                            numTagMonitors--;
+                        }
                     }
                 }
             } else if (f.kinds) {
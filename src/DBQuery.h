@@ -1,10 +1,15 @@
 #pragma once
 
+#include <variant>
+
 #include "golpe.h"
 
 #include "Subscription.h"
 #include "filters.h"
 #include "events.h"
+#include "ScanPool.h"
+#include "LevIdSet.h"
+#include "PubkeyIds.h"
 
 
 struct DBScan : NonCopyable {
@@ -16,27 +21,79 @@ struct DBScan : NonCopyable {
       public:
         CandidateEvent(uint64_t levId, uint64_t created, uint64_t scanIndex) : packed(scanIndex << 40 | created), levIdStorage(levId) {}
 
-        uint64_t levId() { return levIdStorage; }
-        uint64_t created() { return packed & 0xFF'FFFFFFFF; }
-        uint64_t scanIndex() { return packed >> 40; }
+        uint64_t levId() const { return levIdStorage; }
+        uint64_t created() const { return packed & 0xFF'FFFFFFFF; }
+        uint64_t scanIndex() const { return packed >> 40; }
+    };
+
+    // Key matchers. Each cursor's matcher type is fixed when the DBScan is built, and collect()
+    // is instantiated per type, so checking an index key doesn't go through an indirect call.
+
+    struct MatchPrefix {
+        std::string prefix;
+
+        bool operator()(std::string_view k) const {
+            return k.starts_with(prefix);
+        }
+    };
+
+    struct MatchPrefixExact { // prefix followed only by the 8 byte created_at
+        std::string prefix;
+
+        bool operator()(std::string_view k) const {
+            return k.size() == prefix.size() + 8 && k.starts_with(prefix);
+        }
+    };
+
+    struct MatchAll {
+        bool operator()(std::string_view) const {
+            return true;
+        }
     };
 
-    enum class KeyMatchResult {
-        Yes,
-        No,
+    using KeyMatcher = std::variant<MatchPrefix, MatchPrefixExact, MatchAll>;
+
+    // Intersection of two index ranges whose keys are prefix + created_at. Both are walked backwards
+    // in (created_at, levId) order, each one seeking ahead to the other's position, and only levIds
+    // found in both are emitted.
+
+    struct IntersectState {
+        lmdb::dbi otherDbi;
+        std::string prefix; // in DBScan::indexDbi
+        std::string otherPrefix;
+        uint64_t created = MAX_U64; // position to resume from (inclusive)
+        uint64_t levId = MAX_U64;
     };
 
     struct ScanCursor {
         std::string resumeKey;
         uint64_t resumeVal;
-        std::function<KeyMatchResult(std::string_view)> keyMatch;
-        uint64_t outstanding = 0; // number of records remaining in eventQueue, decremented in DBScan::scan
+        KeyMatcher keyMatch;
+        std::vector<CandidateEvent> buffer; // sorted descending by (created, levId)
+        size_t bufferPos = 0; // next entry to be merged, see DBScan::scan
+        std::optional<IntersectState> intersect;
+        bool lastIsResumePoint = false; // last buffer entry is not an event, just where collect() stopped, see collectIntersect()
 
         bool active() {
             return resumeKey.size() > 0;
         }
 
-        uint64_t collect(lmdb::txn &txn, DBScan &s, uint64_t scanIndex, uint64_t limit, std::deque<CandidateEvent> &output) {
+        // Replaces the contents of buffer with up to limit more entries. Returns approximate work done.
+        // Must not modify the DBScan, since cursors may be collected concurrently (see ScanPool)
+        uint64_t collect(lmdb::txn &txn, const DBScan &s, uint64_t scanIndex, uint64_t limit) {
+            buffer.clear();
+            bufferPos = 0;
+            lastIsResumePoint = false;
+
+            if (intersect) return collectIntersect(txn, s, scanIndex, limit, buffer);
+
+            return std::visit([&](const auto &keyMatch){
+                return collectRange(txn, s, keyMatch, scanIndex, limit, buffer);
+            }, keyMatch);
+        }
+
+        template <typename KeyMatch>
+        uint64_t collectRange(lmdb::txn &txn, const DBScan &s, const KeyMatch &keyMatch, uint64_t scanIndex, uint64_t limit, std::vector<CandidateEvent> &output) {
             uint64_t added = 0;
 
             while (active() && limit > 0) {
@@ -47,8 +104,7 @@ struct DBScan : NonCopyable {
                         return false;
                     }
 
-                    auto matched = keyMatch(k);
-                    if (matched == KeyMatchResult::No) {
+                    if (!keyMatch(k)) {
                         resumeKey = "";
                         return false;
                     }
@@ -72,12 +128,10 @@ struct DBScan : NonCopyable {
                         }
                     }
 
-                    if (matched == KeyMatchResult::Yes) {
-                        uint64_t levId = lmdb::from_sv<uint64_t>(v);
-                        output.emplace_back(levId, created, scanIndex);
-                        added++;
-                        limit--;
-                    }
+                    uint64_t levId = lmdb::from_sv<uint64_t>(v);
+                    output.emplace_back(levId, created, scanIndex);
+                    added++;
+                    limit--;
 
                     return true;
                 }, true);
@@ -85,113 +139,308 @@ struct DBScan : NonCopyable {
                 if (finished) resumeKey = "";
             }
 
-            outstanding += added;
             return added;
         }
+
+        // Finds the last entry at or before (prefix + created, levId). Fails if there is none with this prefix and created >= since
+        static bool seek(lmdb::txn &txn, lmdb::dbi dbi, std::string_view prefix, uint64_t since, uint64_t &created, uint64_t &levId) {
+            bool found = false;
+
+            env.generic_foreachFull(txn, dbi, makeKey_StringUint64(prefix, created), lmdb::to_sv<uint64_t>(levId), [&](auto k, auto v) {
+                if (k.size() == prefix.size() + 8 && k.starts_with(prefix)) {
+                    ParsedKey_StringUint64 parsedKey(k);
+                    if (parsedKey.n >= since) {
+                        created = parsedKey.n;
+                        levId = lmdb::from_sv<uint64_t>(v);
+                        found = true;
+                    }
+                }
+                return false;
+            }, true);
+
+            return found;
+        }
+
+        // Two ranges that rarely share an entry can take many steps per entry found, so a call stops after
+        // a number of steps proportional to limit. If it does so while still active, the position it
+        // reached is appended as a resume point: nothing newer can come from this cursor, so the merge
+        // can proceed up to there, and then collects again (after pausing if needed).
+        uint64_t collectIntersect(lmdb::txn &txn, const DBScan &s, uint64_t scanIndex, uint64_t limit, std::vector<CandidateEvent> &output) {
+            static const uint64_t maxStepsPerEntry = 8;
+
+            auto &is = *intersect;
+            uint64_t added = 0;
+            uint64_t work = 0;
+            uint64_t maxWork = 2 * maxStepsPerEntry * limit;
+
+            if (is.created > s.f.until) {
+                is.created = s.f.until;
+                is.levId = MAX_U64;
+            }
+
+            while (active() && limit > 0) {
+                if (work >= maxWork) {
+                    output.emplace_back(is.levId, std::min(is.created, uint64_t(0xFF'FFFFFFFF)), scanIndex);
+                    lastIsResumePoint = true;
+                    break;
+                }
+
+                uint64_t created = is.created, levId = is.levId;
+                work += 2;
+
+                if (!seek(txn, s.indexDbi, is.prefix, s.f.since, created, levId)) {
+                    resumeKey = "";
+                    break;
+                }
+
+                uint64_t otherCreated = created, otherLevId = levId;
+
+                if (!seek(txn, is.otherDbi, is.otherPrefix, s.f.since, otherCreated, otherLevId)) {
+                    resumeKey = "";
+                    break;
+                }
+
+                is.created = otherCreated;
+                is.levId = otherLevId;
+
+                if (otherCreated != created || otherLevId != levId) continue; // other range is behind, so catch up to it
+
+                output.emplace_back(levId, created, scanIndex);
+                added++;
+                limit--;
+
+                // Resume from just before the emitted entry
+
+                if (is.levId > 0) {
+                    is.levId--;
+                } else if (is.created > 0) {
+                    is.created--;
+                    is.levId = MAX_U64;
+                } else {
+                    resumeKey = "";
+                }
+            }
+
+            return added + work;
+        }
+    };
+
+    enum class ScanType {
+        Id,
+        Tag,
+        PubkeyTag,
+        KindTag,
+        TagKind,
+        PubkeyKind,
+        Pubkey,
+        Kind,
+        CreatedAt,
+    };
+
+    // A candidate access path. Estimates are only available if indexStats is loaded
+
+    struct Plan {
+        ScanType type;
+        char tagName = '\0';
+        uint64_t numCursors = 0;
+        bool indexOnly = false;
+        bool intersect = false;
+        uint64_t estEntries = 0; // index entries in the scanned key ranges
+        double estCost = 0;
+
+        std::string name() const {
+            if (type == ScanType::Id) return "ID";
+            else if (type == ScanType::Tag) return "Tag";
+            else if (type == ScanType::PubkeyTag) return "PubkeyTag";
+            else if (type == ScanType::KindTag) return "KindTag";
+            else if (type == ScanType::TagKind) return "TagKind";
+            else if (type == ScanType::PubkeyKind) return "PubkeyKind";
+            else if (type == ScanType::Pubkey) return "Pubkey";
+            else if (type == ScanType::Kind) return "Kind";
+            else return "CreatedAt";
+        }
+
+        std::string desc() const {
+            std::string output = name();
+            if (tagName) output = output + "(" + tagName + ")";
+
+            if (indexStats.isLoaded()) {
+                output += ":";
+                output += std::to_string(estEntries);
+                output += "/";
+                output += std::to_string(uint64_t(estCost));
+            }
+
+            return output;
+        }
     };
 
+    // For testing: if set, and a candidate plan of this type (see Plan::name()) is possible for a
+    // filter, it is used instead of the cheapest one. See "strfry scan --plan"
+    static inline std::string forcedPlan;
+
     const NostrFilter &f;
     bool indexOnly;
     lmdb::dbi indexDbi;
     const char *desc = "?";
+    Plan plan;
+    std::string otherPlans; // rejected candidates, for dbScanPerf log
     std::vector<ScanCursor> cursors;
-    std::deque<CandidateEvent> eventQueue; // sorted descending by created
+    std::vector<CandidateEvent> heap; // next entry of each cursor with any remaining, see scan()
     uint64_t initialScanDepth;
     uint64_t refillScanDepth;
     uint64_t nextInitIndex = 0;
     uint64_t approxWork = 0;
+    ScanPool *scanPool = nullptr; // if set, wide scans collect their cursors' first batches in parallel
 
-    DBScan(const NostrFilter &f) : f(f) {
-        indexOnly = f.indexOnlyScans;
+    // txn is only used to translate pubkeys to ids (see PubkeyIds). Items for pubkeys that have never been
+    // indexed can't match anything, so get no cursor
+    DBScan(lmdb::txn &txn, const NostrFilter &f) : f(f) {
+        plan = choosePlan(f, otherPlans);
+        indexOnly = plan.indexOnly;
 
-        if (f.ids) {
+        if (plan.type == ScanType::Id) {
             indexDbi = env.dbi_Event__id;
             desc = "ID";
 
+            // The index only has id prefixes, so ids are checked when the events are loaded (never index-only).
+            // ids are sorted, so any with the same prefix are adjacent, and share a cursor
+
             cursors.reserve(f.ids->size());
             for (uint64_t i = 0; i < f.ids->size(); i++) {
-                std::string search = f.ids->at(i);
+                std::string search = f.ids->at(i).substr(0, EVENT_ID_INDEX_PREFIX_SIZE);
+                if (cursors.size() && std::get<MatchPrefixExact>(cursors.back().keyMatch).prefix == search) continue;
 
                 cursors.emplace_back(
                     search + std::string(8, '\xFF'),
                     MAX_U64,
-                    [search](std::string_view k){
-                        return k.starts_with(search) ? KeyMatchResult::Yes : KeyMatchResult::No;
-                    }
+                    MatchPrefixExact{ search }
                 );
             }
-        } else if (f.tags.size()) {
+        } else if (plan.type == ScanType::Tag) {
             indexDbi = env.dbi_Event__tag;
             desc = "Tag";
 
-            char tagName = '\0';
-            {
-                uint64_t numTags = MAX_U64;
-                for (const auto &[tn, filterSet] : f.tags) {
-                    if (filterSet.size() < numTags) {
-                        numTags = filterSet.size();
-                        tagName = tn;
-                    }
-                }
-            }
-
+            char tagName = plan.tagName;
             const auto &filterSet = f.tags.at(tagName);
 
             cursors.reserve(filterSet.size());
             for (uint64_t i = 0; i < filterSet.size(); i++) {
-                std::string search;
-                search += tagName;
-                search += filterSet.at(i);
+                auto search = PubkeyIds::lookupTagKey(txn, tagName, filterSet.at(i));
+                if (!search) continue;
 
                 cursors.emplace_back(
-                    search + std::string(8, '\xFF'),
+                    *search + std::string(8, '\xFF'),
                     MAX_U64,
-                    [search](std::string_view k){
-                        return k.size() == search.size() + 8 && k.starts_with(search) ? KeyMatchResult::Yes : KeyMatchResult::No;
-                    }
+                    MatchPrefixExact{ *search }
                 );
             }
-        } else if (f.authors && f.kinds && f.authors->size() * f.kinds->size() < 1'000) {
+        } else if (plan.type == ScanType::PubkeyTag) {
+            indexDbi = env.dbi_Event__tag;
+            desc = "PubkeyTag";
+
+            const auto &filterSet = f.tags.at(plan.tagName);
+
+            std::vector<std::string> authorIds;
+            for (uint64_t j = 0; j < f.authors->size(); j++) {
+                if (auto id = PubkeyIds::lookup(txn, f.authors->at(j))) authorIds.emplace_back(std::move(*id));
+            }
+
+            cursors.reserve(filterSet.size() * authorIds.size());
+            for (uint64_t i = 0; i < filterSet.size(); i++) {
+                auto search = PubkeyIds::lookupTagKey(txn, plan.tagName, filterSet.at(i));
+                if (!search) continue;
+
+                for (const auto &authorId : authorIds) {
+                    auto &c = cursors.emplace_back(*search, MAX_U64, MatchAll{});
+                    c.intersect = IntersectState{
+                        env.dbi_Event__pubkey,
+                        *search,
+                        authorId,
+                    };
+                }
+            }
+        } else if (plan.type == ScanType::KindTag) {
+            // Only used if the tagKind index isn't maintained
+            indexDbi = env.dbi_Event__tag;
+            desc = "KindTag";
+
+            const auto &filterSet = f.tags.at(plan.tagName);
+
+            cursors.reserve(filterSet.size() * f.kinds->size());
+            for (uint64_t i = 0; i < filterSet.size(); i++) {
+                auto search = PubkeyIds::lookupTagKey(txn, plan.tagName, filterSet.at(i));
+                if (!search) continue;
+
+                for (uint64_t j = 0; j < f.kinds->size(); j++) {
+                    auto &c = cursors.emplace_back(*search, MAX_U64, MatchAll{});
+                    c.intersect = IntersectState{
+                        env.dbi_Event__kind,
+                        *search,
+                        std::string(lmdb::to_sv<uint64_t>(f.kinds->at(j))),
+                    };
+                }
+            }
+        } else if (plan.type == ScanType::TagKind) {
+            indexDbi = env.dbi_Event__tagKind;
+            desc = "TagKind";
+
+            const auto &filterSet = f.tags.at(plan.tagName);
+
+            cursors.reserve(filterSet.size() * f.kinds->size());
+            for (uint64_t i = 0; i < filterSet.size(); i++) {
+                auto tagKey = PubkeyIds::lookupTagKey(txn, plan.tagName, filterSet.at(i));
+                if (!tagKey) continue;
+
+                for (uint64_t j = 0; j < f.kinds->size(); j++) {
+                    std::string search = *tagKey;
+                    search += lmdb::to_sv<uint64_t>(f.kinds->at(j));
+
+                    cursors.emplace_back(
+                        search + std::string(8, '\xFF'),
+                        MAX_U64,
+                        MatchPrefixExact{ search }
+                    );
+                }
+            }
+        } else if (plan.type == ScanType::PubkeyKind) {
             indexDbi = env.dbi_Event__pubkeyKind;
             desc = "PubkeyKind";
 
             cursors.reserve(f.authors->size() * f.kinds->size());
             for (uint64_t i = 0; i < f.authors->size(); i++) {
+                auto authorId = PubkeyIds::lookup(txn, f.authors->at(i));
+                if (!authorId) continue;
+
                 for (uint64_t j = 0; j < f.kinds->size(); j++) {
                     uint64_t kind = f.kinds->at(j);
 
-                    std::string search = f.authors->at(i);
+                    std::string search = *authorId;
                     search += lmdb::to_sv<uint64_t>(kind);
 
                     cursors.emplace_back(
                         search + std::string(8, '\xFF'),
                         MAX_U64,
-                        [search, kind](std::string_view k){
-                            if (!k.starts_with(search)) return KeyMatchResult::No;
-                            return KeyMatchResult::Yes;
-                        }
+                        MatchPrefix{ search }
                     );
                 }
             }
-        } else if (f.authors) {
-            if (f.kinds) indexOnly = false; // because of the size limit in previous test
-
+        } else if (plan.type == ScanType::Pubkey) {
             indexDbi = env.dbi_Event__pubkey;
             desc = "Pubkey";
 
             cursors.reserve(f.authors->size());
             for (uint64_t i = 0; i < f.authors->size(); i++) {
-                std::string search = f.authors->at(i);
+                auto search = PubkeyIds::lookup(txn, f.authors->at(i));
+                if (!search) continue;
 
                 cursors.emplace_back(
-                    search + std::string(8, '\xFF'),
+                    *search + std::string(8, '\xFF'),
                     MAX_U64,
-                    [search](std::string_view k){
-                        return k.starts_with(search) ? KeyMatchResult::Yes : KeyMatchResult::No;
-                    }
+                    MatchPrefix{ *search }
                 );
             }
-        } else if (f.kinds) {
+        } else if (plan.type == ScanType::Kind) {
             indexDbi = env.dbi_Event__kind;
             desc = "Kind";
 
@@ -199,13 +448,12 @@ struct DBScan : NonCopyable {
             for (uint64_t i = 0; i < f.kinds->size(); i++) {
                 uint64_t kind = f.kinds->at(i);
 
+                std::string search(lmdb::to_sv<uint64_t>(kind));
+
                 cursors.emplace_back(
-                    std::string(lmdb::to_sv<uint64_t>(kind)) + std::string(8, '\xFF'),
+                    search + std::string(8, '\xFF'),
                     MAX_U64,
-                    [kind](std::string_view k){
-                        ParsedKey_Uint64Uint64 parsedKey(k);
-                        return parsedKey.n1 == kind ? KeyMatchResult::Yes : KeyMatchResult::No;
-                    }
+                    MatchPrefix{ search }
                 );
             }
         } else {
@@ -216,44 +464,223 @@ struct DBScan : NonCopyable {
             cursors.emplace_back(
                 std::string(8, '\xFF'),
                 MAX_U64,
-                [](std::string_view){
-                    return KeyMatchResult::Yes;
-                }
+                MatchAll{}
             );
         }
 
-        initialScanDepth = std::clamp(f.limit / cursors.size(), uint64_t(5), uint64_t(50));
+        heap.reserve(cursors.size());
+
+        initialScanDepth = std::clamp(f.limit / std::max(cursors.size(), size_t(1)), uint64_t(5), uint64_t(50));
         refillScanDepth = 10 * initialScanDepth;
     }
 
-    bool scan(lmdb::txn &txn, const std::function<bool(uint64_t)> &handleEvent, const std::function<bool(uint64_t)> &doPause) {
-        auto cmp = [](auto &a, auto &b){
-            return a.created() == b.created() ? a.levId() > b.levId() : a.created() > b.created();
+    // Without index stats, uses a fixed precedence: ids > tagKind (if indexed) > tags (smallest set) > pubkeyKind > pubkey > kind > created_at
+    // With them, the estimated cheapest path is chosen (ids are always used if present, since they are exact)
+
+    static Plan choosePlan(const NostrFilter &f, std::string &otherPlans) {
+        static const uint64_t maxPubkeyKindCursors = 10'000;
+        static const uint64_t maxIntersectCursors = 1'000;
+        static const uint64_t maxTagKindCursors = 1'000;
+        static const double seekCost = 5; // index descent plus initial collect() batch
+        static const double lookupCost = 10; // lookup_Event() + doesMatch(), as in scan()
+
+        uint64_t numMajorFields = (f.ids ? 1 : 0) + (f.authors ? 1 : 0) + (f.kinds ? 1 : 0) + f.tags.size();
+
+        auto makePlan = [&](ScanType type, uint64_t numCursors, uint64_t numCovered, char tagName = '\0'){
+            Plan p;
+            p.type = type;
+            p.tagName = tagName;
+            p.numCursors = numCursors;
+            p.indexOnly = numCovered == numMajorFields;
+            return p;
+        };
+
+        if (f.ids) return makePlan(ScanType::Id, f.ids->size(), 0); // see DBScan()
+
+        if (!indexStats.isLoaded()) {
+            if (f.tags.size()) {
+                char tagName = '\0';
+                uint64_t numTags = MAX_U64;
+                for (const auto &[tn, filterSet] : f.tags) {
+                    if (filterSet.size() < numTags) {
+                        numTags = filterSet.size();
+                        tagName = tn;
+                    }
+                }
+                if (tagKindIndexed && f.kinds && numTags * f.kinds->size() <= maxTagKindCursors) return makePlan(ScanType::TagKind, numTags * f.kinds->size(), 2, tagName);
+                return makePlan(ScanType::Tag, numTags, 1, tagName);
+            }
+
+            if (f.authors && f.kinds && f.authors->size() * f.kinds->size() < 1'000) return makePlan(ScanType::PubkeyKind, f.authors->size() * f.kinds->size(), 2);
+            if (f.authors) return makePlan(ScanType::Pubkey, f.authors->size(), 1);
+            if (f.kinds) return makePlan(ScanType::Kind, f.kinds->size(), 1);
+            return makePlan(ScanType::CreatedAt, 1, 0);
+        }
+
+        std::vector<Plan> candidates;
+
+        for (const auto &[tn, filterSet] : f.tags) {
+            auto &p = candidates.emplace_back(makePlan(ScanType::Tag, filterSet.size(), 1, tn));
+            for (uint64_t i = 0; i < filterSet.size(); i++) p.estEntries += indexStats.tag(tn, filterSet.at(i));
+        }
+
+        // Intersections: each cursor reads at most about twice the smaller of its two ranges, and
+        // only emits events present in both
+
+        auto addIntersectPlans = [&](ScanType type, uint64_t otherSize, const std::function<uint64_t(uint64_t)> &otherEst){
+            for (const auto &[tn, filterSet] : f.tags) {
+                if (filterSet.size() * otherSize > maxIntersectCursors) continue;
+
+                auto &p = candidates.emplace_back(makePlan(type, filterSet.size() * otherSize, 2, tn));
+                p.intersect = true;
+
+                for (uint64_t i = 0; i < filterSet.size(); i++) {
+                    uint64_t tagEst = indexStats.tag(tn, filterSet.at(i));
+                    for (uint64_t j = 0; j < otherSize; j++) p.estEntries += std::min(tagEst, otherEst(j));
+                }
+            }
+        };
+
+        if (f.authors) addIntersectPlans(ScanType::PubkeyTag, f.authors->size(), [&](uint64_t j){ return indexStats.pubkey(f.authors->at(j)); });
+        if (f.kinds && (!tagKindIndexed || forcedPlan.size())) addIntersectPlans(ScanType::KindTag, f.kinds->size(), [&](uint64_t j){ return indexStats.kind(f.kinds->at(j)); });
+
+        // Tag value + kind: reads only the entries that match both, so each is at most the smaller of the two
+
+        if (tagKindIndexed && f.kinds) {
+            for (const auto &[tn, filterSet] : f.tags) {
+                if (filterSet.size() * f.kinds->size() > maxTagKindCursors) continue;
+
+                auto &p = candidates.emplace_back(makePlan(ScanType::TagKind, filterSet.size() * f.kinds->size(), 2, tn));
+
+                for (uint64_t i = 0; i < filterSet.size(); i++) {
+                    uint64_t tagEst = indexStats.tag(tn, filterSet.at(i));
+                    for (uint64_t j = 0; j < f.kinds->size(); j++) p.estEntries += std::min(tagEst, indexStats.kind(f.kinds->at(j)));
+                }
+            }
+        }
+
+        if (f.authors && f.kinds && f.authors->size() * f.kinds->size() <= maxPubkeyKindCursors) {
+            auto &p = candidates.emplace_back(makePlan(ScanType::PubkeyKind, f.authors->size() * f.kinds->size(), 2));
+            for (uint64_t i = 0; i < f.authors->size(); i++) {
+                for (uint64_t j = 0; j < f.kinds->size(); j++) p.estEntries += indexStats.pubkeyKind(f.authors->at(i), f.kinds->at(j));
+            }
+        }
+
+        if (f.authors) {
+            auto &p = candidates.emplace_back(makePlan(ScanType::Pubkey, f.authors->size(), 1));
+            for (uint64_t i = 0; i < f.authors->size(); i++) p.estEntries += indexStats.pubkey(f.authors->at(i));
+        }
+
+        if (f.kinds) {
+            auto &p = candidates.emplace_back(makePlan(ScanType::Kind, f.kinds->size(), 1));
+            for (uint64_t i = 0; i < f.kinds->size(); i++) p.estEntries += indexStats.kind(f.kinds->at(i));
+        }
+
+        candidates.emplace_back(makePlan(ScanType::CreatedAt, 1, 0)).estEntries = indexStats.total();
+
+        // The number of matching events can't be more than the smallest candidate range. Each candidate
+        // must read (on average) estEntries/estMatches entries per event found, until the limit is reached.
+
+        uint64_t estMatches = MAX_U64;
+        for (const auto &p : candidates) estMatches = std::min(estMatches, p.estEntries);
+        estMatches = std::max(estMatches, uint64_t(1));
+
+        size_t best = 0;
+
+        for (size_t i = 0; i < candidates.size(); i++) {
+            auto &p = candidates[i];
+            double entries = std::max(p.estEntries, uint64_t(1));
+            double entriesRead = entries;
+            if (f.limit < estMatches) entriesRead = std::min(entries, f.limit * entries / estMatches);
+
+            if (p.intersect) p.estCost = p.numCursors * 2 * seekCost + entriesRead * (p.indexOnly ? 2 : 2 + lookupCost);
+            else p.estCost = p.numCursors * seekCost + entriesRead * (p.indexOnly ? 1 : lookupCost);
+            if (p.estCost < candidates[best].estCost) best = i;
+        }
+
+        if (forcedPlan.size()) {
+            for (size_t i = 0; i < candidates.size(); i++) {
+                if (candidates[i].name() == forcedPlan) {
+                    best = i;
+                    break;
+                }
+            }
+        }
+
+        for (size_t i = 0; i < candidates.size(); i++) {
+            if (i == best) continue;
+            if (otherPlans.size()) otherPlans += ",";
+            otherPlans += candidates[i].desc();
+        }
+
+        return candidates[best];
+    }
+
+    // If no event can be found by more than one cursor: each event has a single id, pubkey and kind,
+    // but may have several of the values of a tag
+    bool disjointCursors() const {
+        if (cursors.size() <= 1) return true;
+        return plan.type != ScanType::Tag && plan.type != ScanType::PubkeyTag && plan.type != ScanType::KindTag && plan.type != ScanType::TagKind;
+    }
+
+    // handleEvent(levId, created) returns true to stop the scan. doPause(approxWork) returns true to suspend it
+    //
+    // Cursors are merged with a binary heap holding the next entry from each cursor's buffer, so that events are
+    // visited in descending (created, levId) order. When a cursor's buffer runs out, only that cursor is refilled.
+    template <typename HandleEvent, typename DoPause>
+    bool scan(lmdb::txn &txn, HandleEvent &&handleEvent, DoPause &&doPause) {
+        auto cmp = [](const CandidateEvent &a, const CandidateEvent &b){ // "less", so the newest event is at the top
+            return a.created() == b.created() ? a.levId() < b.levId() : a.created() < b.created();
         };
 
         while (1) {
             approxWork++;
             if (doPause(approxWork)) return false;
 
+            if (nextInitIndex == 0 && scanPool && scanPool->useFor(cursors.size())) {
+                std::atomic<uint64_t> work = 0;
+
+                scanPool->parallelFor(txn, cursors.size(), [&](lmdb::txn &cursorTxn, uint64_t i){
+                    work += cursors[i].collect(cursorTxn, *this, i, initialScanDepth);
+                });
+
+                approxWork += work;
+
+                for (auto &cursor : cursors) {
+                    if (cursor.buffer.size()) heap.push_back(cursor.buffer[0]);
+                }
+
+                nextInitIndex = cursors.size();
+                std::make_heap(heap.begin(), heap.end(), cmp);
+                continue;
+            }
+
             if (nextInitIndex < cursors.size()) {
-                approxWork += cursors[nextInitIndex].collect(txn, *this, nextInitIndex, initialScanDepth, eventQueue);
+                auto &cursor = cursors[nextInitIndex];
+                approxWork += cursor.collect(txn, *this, nextInitIndex, initialScanDepth);
+                if (cursor.buffer.size()) heap.push_back(cursor.buffer[0]);
                 nextInitIndex++;
 
                 if (nextInitIndex == cursors.size()) {
-                    std::sort(eventQueue.begin(), eventQueue.end(), cmp);
+                    std::make_heap(heap.begin(), heap.end(), cmp);
                 }
 
                 continue;
-            } else if (eventQueue.size() == 0) {
+            } else if (heap.size() == 0) {
                 return true;
             }
 
-            auto ev = eventQueue.front();
-            eventQueue.pop_front();
+            std::pop_heap(heap.begin(), heap.end(), cmp);
+            auto ev = heap.back();
+            heap.pop_back();
+
+            auto &cursor = cursors[ev.scanIndex()];
             bool doSend = false;
             uint64_t levId = ev.levId();
 
-            if (indexOnly) {
+            if (cursor.lastIsResumePoint && cursor.bufferPos == cursor.buffer.size() - 1) {
+                // not an event, see collectIntersect()
+            } else if (indexOnly) {
                 if (f.doesMatchTimes(ev.created())) doSend = true;
             } else {
                 approxWork += 10;
@@ -262,18 +689,18 @@ struct DBScan : NonCopyable {
             }
 
             if (doSend) {
-                if (handleEvent(levId)) return true;
+                if (handleEvent(levId, ev.created())) return true;
             }
 
-            cursors[ev.scanIndex()].outstanding--;
+            cursor.bufferPos++;
 
-            if (cursors[ev.scanIndex()].outstanding == 0) {
-                std::deque<CandidateEvent> moreEvents;
-                std::deque<CandidateEvent> newEventQueue;
-                approxWork += cursors[ev.scanIndex()].collect(txn, *this, ev.scanIndex(), refillScanDepth, moreEvents);
+            if (cursor.bufferPos == cursor.buffer.size()) {
+                approxWork += cursor.collect(txn, *this, ev.scanIndex(), refillScanDepth);
+            }
 
-                std::merge(eventQueue.begin(), eventQueue.end(), moreEvents.begin(), moreEvents.end(), std::back_inserter(newEventQueue), cmp);
-                eventQueue.swap(newEventQueue);
+            if (cursor.bufferPos < cursor.buffer.size()) {
+                heap.push_back(cursor.buffer[cursor.bufferPos]);
+                std::push_heap(heap.begin(), heap.end(), cmp);
             }
         }
     }
@@ -281,45 +708,95 @@ struct DBScan : NonCopyable {
 
 
 struct DBQuery : NonCopyable {
+    struct FoundEvent {
+        uint64_t levId;
+        uint64_t created;
+    };
+
     Subscription sub;
 
     std::unique_ptr<DBScan> scanner;
     size_t filterGroupIndex = 0;
-    bool dead = false; // external flag
-    flat_hash_set<uint64_t> sentEventsFull;
-    flat_hash_set<uint64_t> sentEventsCurr;
+    std::atomic<bool> dead = false; // external flag
+    LevIdSet sentEventsFull; // only if more than one filter
+    LevIdSet sentEventsCurr; // only if the current scan's cursors can overlap
+    uint64_t numSent = 0; // distinct events sent, across all filters
+    uint64_t numFoundCurr = 0; // distinct events found by the current filter
+    std::vector<uint64_t> sentEventsOrdered; // only if recordSent
+    bool recordSent = false;
+    std::vector<std::vector<FoundEvent>> filterResults; // only if recordResults: for each filter, the distinct events its scan found, in scan order
+    bool recordResults = false;
+    std::vector<Subscription> followers; // other subscriptions sharing this scan, see QueryScheduler
+    std::string filterKey; // canonical filter group, see QueryScheduler
+    ScanPool *scanPool = nullptr; // passed on to each DBScan
+    uint64_t maxEvents = MAX_U64; // across all filters
+    bool hitMaxEvents = false; // scan was stopped early because of maxEvents
+
+    // If set, this query is answered from a cached result instead of by scanning, see QueryScheduler::runTopUp()
+    struct CacheTopUp {
+        std::vector<std::vector<FoundEvent>> cached; // for each filter, as in filterResults
+        std::vector<std::vector<FoundEvent>> newer; // matching events stored since the cached result
+        uint64_t nextLevId; // next event to match
+    };
+
+    std::unique_ptr<CacheTopUp> topUp;
     uint64_t lastWorkChecked = 0;
 
     uint64_t currScanTime = 0;
     uint64_t currScanSaveRestores = 0;
     uint64_t totalTime = 0;
     uint64_t totalWork = 0;
+    uint64_t chargedTime = 0; // portion of usedTime() already accounted for by QueryScheduler
 
     DBQuery(Subscription &sub) : sub(std::move(sub)) {}
     DBQuery(const tao::json::value &filter, uint64_t maxLimit = MAX_U64) : sub(Subscription(1, ".", NostrFilterGroup(filter, maxLimit))) {}
 
+    // Microseconds spent scanning so far, across all filters
+    uint64_t usedTime() const {
+        return totalTime + currScanTime;
+    }
+
     // If scan is complete, returns true
-    bool process(lmdb::txn &txn, const std::function<void(const Subscription &, uint64_t)> &cb, uint64_t timeBudgetMicroseconds = MAX_U64, bool logMetrics = false) {
-        while (filterGroupIndex < sub.filterGroup.size()) {
+    template <typename F> // void(const Subscription &, uint64_t levId)
+    bool process(lmdb::txn &txn, F &&cb, uint64_t timeBudgetMicroseconds = MAX_U64, bool logMetrics = false) {
+        if (recordResults && filterResults.empty()) filterResults.resize(sub.filterGroup.size());
+
+        // Events from different filters are only deduplicated when there are several of them, and events
+        // from different cursors only when the cursors can overlap (see DBScan::disjointCursors)
+        bool multiFilter = sub.filterGroup.size() > 1;
+
+        while (filterGroupIndex < sub.filterGroup.size() && !hitMaxEvents) {
             const auto &f = sub.filterGroup.filters[filterGroupIndex];
 
-            if (!scanner) scanner = std::make_unique<DBScan>(f);
+            if (!scanner) {
+                scanner = std::make_unique<DBScan>(txn, f);
+                scanner->scanPool = scanPool;
+            }
 
             uint64_t startTime = hoytech::curr_time_us();
+            bool dedupCurr = !scanner->disjointCursors();
 
-            bool complete = scanner->scan(txn, [&](uint64_t levId){
+            bool complete = scanner->scan(txn, [&](uint64_t levId, uint64_t created){
                 if (f.limit == 0) return true;
 
                 // If this event came in after our query began, don't send it. It will be sent after the EOSE.
                 if (levId > sub.latestEventId) return false;
 
-                if (sentEventsFull.find(levId) == sentEventsFull.end()) {
-                    sentEventsFull.insert(levId);
+                if (dedupCurr && !sentEventsCurr.insert(levId)) return false;
+
+                if (!multiFilter || sentEventsFull.insert(levId)) {
+                    if (numSent >= maxEvents) {
+                        hitMaxEvents = true;
+                        return true;
+                    }
+
+                    numSent++;
+                    if (recordSent) sentEventsOrdered.push_back(levId);
                     cb(sub, levId);
                 }
 
-                sentEventsCurr.insert(levId);
-                return sentEventsCurr.size() >= f.limit;
+                if (recordResults) filterResults[filterGroupIndex].push_back({ levId, created });
+                return ++numFoundCurr >= f.limit;
             }, [&](uint64_t approxWork){
                 if (approxWork > lastWorkChecked + 2'000) {
                     lastWorkChecked = approxWork;
@@ -341,10 +818,12 @@ struct DBQuery : NonCopyable {
             if (logMetrics) {
                 LI << "[" << sub.connId << "] REQ='" << sub.subId.sv() << "'"
                    << " scan=" << scanner->desc
+                   << " plan=" << scanner->plan.desc()
+                   << " otherPlans=" << (scanner->otherPlans.size() ? scanner->otherPlans : "-")
                    << " indexOnly=" << scanner->indexOnly
                    << " time=" << currScanTime << "us"
                    << " saveRestores=" << currScanSaveRestores
-                   << " recsFound=" << sentEventsCurr.size()
+                   << " recsFound=" << numFoundCurr
                    << " work=" << scanner->approxWork;
                 ;
             }
@@ -352,6 +831,7 @@ struct DBQuery : NonCopyable {
             scanner.reset();
             filterGroupIndex++;
             sentEventsCurr.clear();
+            numFoundCurr = 0;
 
             currScanTime = 0;
             currScanSaveRestores = 0;
@@ -361,7 +841,7 @@ struct DBQuery : NonCopyable {
             LI << "[" << sub.connId << "] REQ='" << sub.subId.sv() << "'"
                << " totalTime=" << totalTime << "us"
                << " totalWork=" << totalWork
-               << " recsSent=" << sentEventsFull.size()
+               << " recsSent=" << numSent
             ;
         }
 
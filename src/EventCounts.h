@@ -0,0 +1,343 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <optional>
+
+#include "golpe.h"
+
+#include "PackedEvent.h"
+#include "filters.h"
+
+
+// Exact counts of stored events per kind, per pubkey+kind, and per tag value+kind, kept in the
+// EventCount table. Used to answer common NIP-45 COUNT filters (followers, reactions, notes by an
+// author, etc) without scanning.
+//
+// Counts are updated by writeEvents()/deleteEventBasic() in the same write txn as the events
+// themselves, so they are always consistent with the DB, including writes by other processes.
+// "strfry counts build" populates the table in batches of events, each in its own write txn, so the
+// relay can keep writing in between. While a build is in progress, writers only maintain counts of
+// the events it has already passed (new events are always after it, and will be counted by the
+// build). Counts are not used to answer queries until the build has finished. The tag names to count
+// are chosen at build time and stored in the table, so every writer agrees on them.
+//
+// For counted e and p tags, NIP-45 HyperLogLog registers are also kept per tag value and kind, so
+// that the "hll" field can be returned for COUNTs like reactions to an event or followers of a
+// pubkey. Registers are stored sparsely as (index, value) byte pairs until that would be larger
+// than the 256 dense registers. A sketch can't forget an event, so deletions aren't reflected
+// until the next build.
+//
+// Keys:
+//   'M' -> tag names being counted (present only once built)
+//   'P' -> levId the build has reached + tag names being counted (present only while building)
+//   'K' + kind -> count
+//   'B' + pubkey + kind -> count
+//   'T' + kind + tagName + tagVal -> count
+//   'H' + kind + tagName + tagVal -> HLL registers
+
+struct EventCounts {
+    // Returns the counted tag names, or nullopt if counts haven't been built
+    static std::optional<std::string> countedTags(lmdb::txn &txn) {
+        std::string_view v;
+        if (!env.dbi_EventCount.get(txn, "M", v)) return std::nullopt;
+        return std::string(v);
+    }
+
+    // Which events writers must keep counts for: those with levIds below upTo
+    struct Maintained {
+        std::string tagNames;
+        uint64_t upTo;
+    };
+
+    // Returns nullopt if counts are neither built nor being built
+    static std::optional<Maintained> maintained(lmdb::txn &txn) {
+        std::string_view v;
+        if (env.dbi_EventCount.get(txn, "M", v)) return Maintained{ std::string(v), MAX_U64 };
+        if (env.dbi_EventCount.get(txn, "P", v)) return Maintained{ std::string(v.substr(8)), lmdb::from_sv<uint64_t>(v.substr(0, 8)) };
+        return std::nullopt;
+    }
+
+    static void add(lmdb::txn &txn, const Maintained &m, uint64_t levId, PackedEventView ev) {
+        if (levId >= m.upTo) return;
+        update(txn, m.tagNames, ev, 1);
+        updateHll(txn, m.tagNames, ev);
+    }
+
+    static void remove(lmdb::txn &txn, const Maintained &m, uint64_t levId, PackedEventView ev) {
+        if (levId >= m.upTo) return;
+        update(txn, m.tagNames, ev, -1);
+    }
+
+    // Clears any existing counts, and starts a build. Follow with buildBatch() until it returns true
+    static void beginBuild(lmdb::txn &txn, std::string_view tagNames) {
+        drop(txn);
+        setProgress(txn, 0, tagNames);
+    }
+
+    // Counts up to batchSize more events, adding the number counted to numEvents. Returns true once
+    // all events have been counted, at which point the counts are ready to use.
+    static bool buildBatch(lmdb::txn &txn, uint64_t batchSize, uint64_t &numEvents) {
+        auto m = maintained(txn);
+        if (!m || m->upTo == MAX_U64) throw herr("no counts build in progress");
+
+        flat_hash_map<std::string, uint64_t> counts;
+        uint64_t processed = 0;
+        uint64_t next = m->upTo;
+
+        env.foreach_Event(txn, [&](auto &ev){
+            PackedEventView packed(ev.buf);
+            foreachKey(m->tagNames, packed, [&](const std::string &key){
+                counts[key]++;
+            });
+            updateHll(txn, m->tagNames, packed);
+            next = ev.primaryKeyId + 1;
+            return ++processed < batchSize;
+        }, false, m->upTo);
+
+        for (const auto &[key, n] : counts) env.dbi_EventCount.put(txn, key, lmdb::to_sv<uint64_t>(get(txn, key) + n));
+
+        numEvents += processed;
+
+        if (processed < batchSize) {
+            env.dbi_EventCount.del(txn, "P");
+            env.dbi_EventCount.put(txn, "M", m->tagNames);
+            return true;
+        }
+
+        setProgress(txn, next, m->tagNames);
+        return false;
+    }
+
+    static void drop(lmdb::txn &txn) {
+        lmdb::dbi_drop(txn, env.dbi_EventCount);
+    }
+
+    // Returns the number of events matching the group (up to the filter's limit), if it can be answered
+    // from the counts.
+    // Only groups of one filter with kinds, and at most one of: authors, a single tag value. Sets of
+    // events counted under different kinds or authors can't overlap, so their counts can be summed.
+    static std::optional<uint64_t> count(lmdb::txn &txn, const NostrFilterGroup &fg) {
+        if (fg.filters.size() == 0) return 0; // never matches
+        if (fg.filters.size() != 1) return std::nullopt;
+
+        const auto &f = fg.filters[0];
+        if (f.ids || !f.kinds || f.since != 0 || f.until != MAX_U64) return std::nullopt;
+
+        auto tagNames = countedTags(txn);
+        if (!tagNames) return std::nullopt;
+
+        std::string key;
+        uint64_t total = 0;
+
+        if (f.tags.size() == 0) {
+            if (!f.authors) {
+                for (auto kind : f.kinds->items) {
+                    total += get(txn, makeKey('K', "", kind, key));
+                }
+            } else {
+                for (size_t i = 0; i < f.authors->size(); i++) {
+                    auto author = f.authors->at(i);
+                    for (auto kind : f.kinds->items) {
+                        total += get(txn, makeKey('B', author, kind, key));
+                    }
+                }
+            }
+        } else if (f.tags.size() == 1 && !f.authors) {
+            const auto &[tagName, tagVals] = *f.tags.begin();
+            if (tagVals.size() != 1) return std::nullopt; // one event can have several of the values
+
+            if (tagNames->find(tagName) == std::string::npos) return std::nullopt;
+
+            auto tagKey = std::string(1, tagName) + tagVals.at(0);
+
+            for (auto kind : f.kinds->items) {
+                total += get(txn, makeTagKey(kind, tagKey, key));
+            }
+        } else {
+            return std::nullopt;
+        }
+
+        return std::min(total, f.limit); // as a scan would stop at the limit
+    }
+
+    // NIP-45 HyperLogLog registers, as stored: sparse (index, value) byte pairs, or all 256 registers
+    struct HllRegisters {
+        uint8_t r[256] = {};
+
+        void merge(std::string_view encoded) {
+            if (encoded.size() == sizeof(r)) {
+                for (size_t i = 0; i < sizeof(r); i++) r[i] = std::max(r[i], uint8_t(encoded[i]));
+            } else {
+                for (size_t i = 0; i + 1 < encoded.size(); i += 2) set(uint8_t(encoded[i]), uint8_t(encoded[i + 1]));
+            }
+        }
+
+        bool set(uint8_t index, uint8_t value) {
+            if (r[index] >= value) return false;
+            r[index] = value;
+            return true;
+        }
+
+        std::string encode() const {
+            std::string sparse;
+
+            for (size_t i = 0; i < sizeof(r); i++) {
+                if (!r[i]) continue;
+                if (sparse.size() + 2 >= sizeof(r)) return std::string((const char*)r, sizeof(r));
+                sparse += char(i);
+                sparse += char(r[i]);
+            }
+
+            return sparse;
+        }
+    };
+
+    // NIP-45: the offset is derived from the tag value (the hex digit at position 32, plus 8). The
+    // register index is the author's pubkey byte at that offset, and its value is 1 + the number of
+    // leading zero bits following it. tagVal and pubkey must be 32 bytes. Returns (index, value).
+    static std::pair<uint8_t, uint8_t> hllRegister(std::string_view tagVal, std::string_view pubkey) {
+        size_t offset = (uint8_t(tagVal[16]) >> 4) + 8;
+        uint8_t index = uint8_t(pubkey[offset]);
+        uint8_t value = 1;
+
+        for (size_t i = offset + 1; i < pubkey.size(); i++) {
+            uint8_t b = uint8_t(pubkey[i]);
+            if (b == 0) {
+                value += 8;
+                continue;
+            }
+            while (!(b & 0x80)) {
+                value++;
+                b <<= 1;
+            }
+            break;
+        }
+
+        return { index, value };
+    }
+
+    // Returns the hex-encoded NIP-45 HLL registers for the group, if it is eligible: one filter with
+    // kinds and a single value of a counted e or p tag, and nothing else. The registers of each kind
+    // are merged, which gives the sketch of all the events of those kinds.
+    //
+    // The registers only ever grow: events are added when written, but deleting an event doesn't
+    // remove it, so after deletions the sketch over-estimates until "strfry counts build" is run again
+    // (the exact count, which is decremented, is unaffected).
+    static std::optional<std::string> hll(lmdb::txn &txn, const NostrFilterGroup &fg) {
+        if (fg.filters.size() != 1) return std::nullopt;
+
+        const auto &f = fg.filters[0];
+        if (f.ids || f.authors || !f.kinds || f.since != 0 || f.until != MAX_U64 || f.tags.size() != 1) return std::nullopt;
+
+        const auto &[tagName, tagVals] = *f.tags.begin();
+        if (!isHllTag(tagName) || tagVals.size() != 1) return std::nullopt;
+
+        auto tagNames = countedTags(txn);
+        if (!tagNames || tagNames->find(tagName) == std::string::npos) return std::nullopt;
+
+        auto tagKey = std::string(1, tagName) + tagVals.at(0);
+        HllRegisters regs;
+        std::string key;
+
+        for (auto kind : f.kinds->items) {
+            std::string_view v;
+            if (env.dbi_EventCount.get(txn, makeTagKey(kind, tagKey, key, 'H'), v)) regs.merge(v);
+        }
+
+        return to_hex(std::string_view((const char*)regs.r, sizeof(regs.r)));
+    }
+
+  private:
+    static void setProgress(lmdb::txn &txn, uint64_t upTo, std::string_view tagNames) {
+        std::string v(lmdb::to_sv<uint64_t>(upTo));
+        v += tagNames;
+        env.dbi_EventCount.put(txn, "P", v);
+    }
+
+    static bool isHllTag(char tagName) {
+        return tagName == 'e' || tagName == 'p';
+    }
+
+    static std::string_view makeKey(char type, std::string_view pubkey, uint64_t kind, std::string &key) {
+        key.clear();
+        key += type;
+        key += pubkey;
+        key += lmdb::to_sv<uint64_t>(kind);
+        return key;
+    }
+
+    static std::string_view makeTagKey(uint64_t kind, std::string_view tagKey, std::string &key, char type = 'T') {
+        key.clear();
+        key += type;
+        key += lmdb::to_sv<uint64_t>(kind);
+        key += tagKey;
+        return key;
+    }
+
+    static uint64_t get(lmdb::txn &txn, std::string_view key) {
+        std::string_view v;
+        if (!env.dbi_EventCount.get(txn, key, v)) return 0;
+        return lmdb::from_sv<uint64_t>(v);
+    }
+
+    template <typename F>
+    static void foreachKey(std::string_view tagNames, PackedEventView ev, F cb) {
+        std::string key;
+
+        makeKey('K', "", ev.kind(), key);
+        cb(key);
+
+        makeKey('B', ev.pubkey(), ev.kind(), key);
+        cb(key);
+
+        if (tagNames.empty()) return;
+
+        flat_hash_set<std::string> seen; // an event with a repeated tag is only counted once
+
+        ev.foreachTag([&](char tagName, std::string_view tagVal){
+            if (tagNames.find(tagName) == std::string_view::npos) return true;
+
+            auto tagKey = std::string(1, tagName) + std::string(tagVal);
+            if (!seen.insert(tagKey).second) return true;
+
+            makeTagKey(ev.kind(), tagKey, key);
+            cb(key);
+            return true;
+        });
+    }
+
+    static void updateHll(lmdb::txn &txn, std::string_view tagNames, PackedEventView ev) {
+        auto pubkey = ev.pubkey();
+        flat_hash_set<std::string_view> seen;
+        std::string key;
+
+        ev.foreachTag([&](char tagName, std::string_view tagVal){
+            if (!isHllTag(tagName) || tagVal.size() != 32 || tagNames.find(tagName) == std::string_view::npos) return true;
+            if (!seen.insert(tagVal).second) return true;
+
+            auto [index, value] = hllRegister(tagVal, pubkey);
+
+            makeTagKey(ev.kind(), std::string(1, tagName) + std::string(tagVal), key, 'H');
+
+            HllRegisters regs;
+            std::string_view v;
+            if (env.dbi_EventCount.get(txn, key, v)) regs.merge(v);
+
+            if (regs.set(index, value)) env.dbi_EventCount.put(txn, key, regs.encode());
+            return true;
+        });
+    }
+
+    static void update(lmdb::txn &txn, std::string_view tagNames, PackedEventView ev, int64_t delta) {
+        foreachKey(tagNames, ev, [&](const std::string &key){
+            uint64_t n = get(txn, key);
+
+            if (delta < 0 && n <= uint64_t(-delta)) {
+                env.dbi_EventCount.del(txn, key);
+            } else {
+                env.dbi_EventCount.put(txn, key, lmdb::to_sv<uint64_t>(n + delta));
+            }
+        });
+    }
+};
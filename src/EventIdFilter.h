@@ -0,0 +1,253 @@
+#pragma once
+
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <shared_mutex>
+#include <atomic>
+#include <thread>
+
+#include "golpe.h"
+
+
+// In-memory cuckoo filter of the IDs of stored events. Used to detect duplicate events before
+// spending CPU on hashing and signature verification.
+//
+// A hit only means the event *may* be stored, and must be confirmed with lookupEventById(). A miss
+// is not authoritative either: events written by other processes (import, router, etc) are not
+// seen until the filter is next loaded, and a failed insert drops an entry. So misses must take
+// the normal (verifying) path, and writeEvents() still does its own duplicate check.
+//
+// Event IDs are already uniformly distributed hashes, so bucket indices and fingerprints are
+// taken directly from the ID bytes. Only IDs of stored (verified) events are ever inserted.
+//
+// When the filter gets too full, a larger one is built from the id index on a background thread, so
+// that the writer isn't held up by the scan. The first one is built the same way, see loadInBackground(). Inserts and removes made meanwhile are recorded, and
+// replayed into the new table before it replaces the old one. Some of these may already be reflected
+// in the scan, but a repeated insert or remove can only cause a false hit or a miss, both harmless.
+
+struct EventIdFilter : NonCopyable {
+    ~EventIdFilter() {
+        stopping = true;
+        if (growThread.joinable()) growThread.join();
+    }
+
+    // Starts building the filter from the Event__id index on a background thread, if enabled in config,
+    // so that startup isn't held up by the scan. Does nothing if already loaded. Until it is built nothing
+    // is reported as present, and changes are recorded as when growing.
+    void loadInBackground() {
+        if (!cfg().events__eventIdFilter) return;
+
+        std::unique_lock<std::mutex> lk(loadMutex);
+        if (loaded) return;
+
+        table = std::make_unique<Table>(MinBuckets);
+        growing = true;
+        loaded = true;
+
+        rebuild();
+    }
+
+    bool isLoaded() const {
+        return loaded;
+    }
+
+    bool mayContain(std::string_view id) const {
+        if (!loaded || id.size() != 32) return false;
+
+        std::shared_lock<std::shared_mutex> lk(mutex);
+
+        uint16_t fp = fingerprint(id);
+        uint64_t i1 = index1(id) & table->mask;
+        return table->bucketHas(i1, fp) || table->bucketHas(table->altIndex(i1, fp), fp);
+    }
+
+    void insert(std::string_view id) {
+        if (!loaded || id.size() != 32) return;
+
+        std::unique_lock<std::shared_mutex> lk(mutex);
+        table->insert(index1(id), fingerprint(id));
+        if (growing) journal.push_back({ true, index1(id), fingerprint(id) });
+    }
+
+    void remove(std::string_view id) {
+        if (!loaded || id.size() != 32) return;
+
+        std::unique_lock<std::shared_mutex> lk(mutex);
+        table->remove(index1(id), fingerprint(id));
+        if (growing) journal.push_back({ false, index1(id), fingerprint(id) });
+    }
+
+    // If the filter is too full for inserts to reliably succeed, starts building a larger one in the
+    // background. Should be called by the writer before it modifies anything in its write txn, so that
+    // the background read txn sees every event inserted before changes started being recorded.
+    void growIfNeeded() {
+        if (!loaded) return;
+
+        {
+            std::unique_lock<std::shared_mutex> lk(mutex);
+            if (growing) return;
+            if (!table->overflowed && table->numItems * 10 <= table->slots.size() * 9) return;
+            growing = true;
+        }
+
+        rebuild();
+    }
+
+  private:
+    static constexpr uint64_t BucketSize = 4;
+    static constexpr uint64_t MinBuckets = 1 << 14;
+    static constexpr uint64_t MaxKicks = 500;
+
+    struct Table {
+        uint64_t mask;
+        std::vector<uint16_t> slots; // 0 means empty
+        uint64_t numItems = 0;
+        uint64_t kickCounter = 0;
+        bool overflowed = false;
+
+        Table(uint64_t numBuckets) : mask(numBuckets - 1), slots(numBuckets * BucketSize, 0) {}
+
+        uint64_t altIndex(uint64_t i, uint16_t fp) const {
+            return (i ^ (uint64_t(fp) * 0x5bd1e995)) & mask;
+        }
+
+        bool bucketHas(uint64_t i, uint16_t fp) const {
+            const uint16_t *b = &slots[i * BucketSize];
+            return b[0] == fp || b[1] == fp || b[2] == fp || b[3] == fp;
+        }
+
+        bool bucketAdd(uint64_t i, uint16_t fp) {
+            uint16_t *b = &slots[i * BucketSize];
+            for (uint64_t j = 0; j < BucketSize; j++) {
+                if (b[j] == 0) {
+                    b[j] = fp;
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void insert(uint64_t i1, uint16_t fp) {
+            i1 &= mask;
+            uint64_t i2 = altIndex(i1, fp);
+
+            if (bucketAdd(i1, fp) || bucketAdd(i2, fp)) {
+                numItems++;
+                return;
+            }
+
+            // Both buckets full: evict entries to their alternate buckets
+
+            uint64_t i = (kickCounter & 1) ? i1 : i2;
+
+            for (uint64_t n = 0; n < MaxKicks; n++) {
+                std::swap(fp, slots[i * BucketSize + (kickCounter++ % BucketSize)]);
+                i = altIndex(i, fp);
+
+                if (bucketAdd(i, fp)) {
+                    numItems++;
+                    return;
+                }
+            }
+
+            // The last evicted fingerprint is lost. This can only cause misses, which are harmless
+            overflowed = true;
+        }
+
+        void remove(uint64_t i1, uint16_t fp) {
+            i1 &= mask;
+
+            for (uint64_t i : { i1, altIndex(i1, fp) }) {
+                uint16_t *b = &slots[i * BucketSize];
+                for (uint64_t j = 0; j < BucketSize; j++) {
+                    if (b[j] == fp) {
+                        b[j] = 0;
+                        if (numItems) numItems--;
+                        return;
+                    }
+                }
+            }
+        }
+    };
+
+    struct JournalEntry {
+        bool insert;
+        uint64_t i1;
+        uint16_t fp;
+    };
+
+    std::unique_ptr<Table> table;
+    bool growing = false; // protected by mutex
+    std::vector<JournalEntry> journal; // changes since growing started, protected by mutex
+    std::thread growThread;
+    mutable std::shared_mutex mutex;
+    std::mutex loadMutex;
+    std::atomic<bool> loaded = false;
+    std::atomic<bool> stopping = false; // abandon any build in progress, so exiting isn't held up by it
+
+    // Builds a new table on growThread, replacing the current one once done. growing must be set
+    void rebuild() {
+        if (growThread.joinable()) growThread.join();
+
+        growThread = std::thread([this]{
+            setThreadName("EventIdFilter");
+
+            std::unique_ptr<Table> newTable;
+
+            try {
+                auto txn = env.txn_ro();
+                newTable = build(txn);
+            } catch (std::exception &e) {
+                LE << "Couldn't build event ID filter: " << e.what();
+            }
+
+            std::unique_lock<std::shared_mutex> lk(mutex);
+
+            if (newTable) {
+                for (const auto &j : journal) {
+                    if (j.insert) newTable->insert(j.i1, j.fp);
+                    else newTable->remove(j.i1, j.fp);
+                }
+
+                table = std::move(newTable);
+            }
+
+            journal.clear();
+            journal.shrink_to_fit();
+            growing = false;
+        });
+    }
+
+    std::unique_ptr<Table> build(lmdb::txn &txn) {
+        uint64_t numEvents = env.dbi_Event__id.stat(txn).ms_entries;
+
+        // Aim for a load factor of at most 50%
+
+        uint64_t numBuckets = MinBuckets;
+        while (numBuckets * BucketSize < numEvents * 2) numBuckets *= 2;
+
+        auto newTable = std::make_unique<Table>(numBuckets);
+
+        env.generic_foreachFull(txn, env.dbi_Event__id, "", "", [&](auto k, auto v) {
+            std::string_view id = k.substr(0, EVENT_ID_INDEX_PREFIX_SIZE); // enough for index1() and fingerprint()
+            newTable->insert(index1(id), fingerprint(id));
+            return !stopping;
+        });
+
+        if (stopping) return nullptr;
+
+        LI << "Event ID filter: " << newTable->numItems << " events, " << renderSize(numBuckets * BucketSize * sizeof(uint16_t));
+
+        return newTable;
+    }
+
+    static uint64_t index1(std::string_view id) {
+        return lmdb::from_sv<uint64_t>(id.substr(0, 8));
+    }
+
+    static uint16_t fingerprint(std::string_view id) {
+        uint16_t fp = lmdb::from_sv<uint16_t>(id.substr(8, 2));
+        return fp == 0 ? 1 : fp;
+    }
+};
@@ -0,0 +1,468 @@
+#include <tao/json.hpp>
+
+#include "EventParser.h"
+
+
+// Output must be identical to tao::json's string escaping, since it is hashed and
+// compared against event ids that were previously computed from tao::json::to_string()
+
+static void appendJsonString(std::string &out, std::string_view s) {
+    static const char *hexDigits = "0123456789abcdef";
+
+    out += '"';
+
+    size_t start = 0;
+
+    for (size_t i = 0; i < s.size(); i++) {
+        unsigned char c = (unsigned char)s[i];
+        if (c >= 32 && c != '\\' && c != '"' && c != 127) continue;
+
+        out.append(s.data() + start, i - start);
+        start = i + 1;
+
+        switch (c) {
+            case '\\': out += "\\\\"; break;
+            case '"': out += "\\\""; break;
+            case '\b': out += "\\b"; break;
+            case '\f': out += "\\f"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                out += "\\u00";
+                out += hexDigits[c >> 4];
+                out += hexDigits[c & 0x0F];
+        }
+    }
+
+    out.append(s.data() + start, s.size() - start);
+
+    out += '"';
+}
+
+
+bool EventParser::isEventMessage(std::string_view msg) {
+    auto skipWhitespace = [&]{
+        while (msg.size() && (msg[0] == ' ' || msg[0] == '\t' || msg[0] == '\n' || msg[0] == '\r')) msg.remove_prefix(1);
+    };
+
+    skipWhitespace();
+    if (!msg.starts_with('[')) return false;
+    msg.remove_prefix(1);
+
+    skipWhitespace();
+    if (!msg.starts_with("\"EVENT\"")) return false;
+    msg.remove_prefix(7);
+
+    skipWhitespace();
+    return msg.starts_with(',');
+}
+
+void EventParser::parseMessage(std::string_view msg) {
+    reset(true);
+
+    tao::json::events::from_string(*this, msg);
+
+    if (msgElem < 2) throw herr("too few array elements");
+
+    if (tagsHaveObject && err.empty()) reserialiseTags(msg);
+}
+
+void EventParser::parseEvent(std::string_view json) {
+    reset(false);
+
+    tao::json::events::from_string(*this, json);
+
+    if (tagsHaveObject && err.empty()) reserialiseTags(json);
+}
+
+// Objects can appear in tags (past the name and value), and must be serialised the way the tao::json
+// DOM did before this parser existed, since that's what their event ids were computed from: keys
+// sorted, and duplicate keys rejected. Such tags are rare, so the input is just parsed again as a DOM.
+
+void EventParser::reserialiseTags(std::string_view json) {
+    auto v = tao::json::from_string(json);
+    const auto &ev = wrapped ? v.get_array().at(1) : v;
+    tagsJson = tao::json::to_string(ev.at("tags"));
+}
+
+void EventParser::verify(secp256k1_context *secpCtx, bool verifyMsg, bool verifyTime, std::string &packedStr, std::string &jsonStr) {
+    build(verifyMsg, verifyTime, packedStr, jsonStr);
+
+    if (verifyMsg) {
+        PackedEventView packed(packedStr);
+        bool valid = verifySig(secpCtx, from_hex(sigVal, false), packed.id(), packed.pubkey());
+        if (!valid) throw herr("bad signature");
+    }
+}
+
+void EventParser::build(bool verifyMsg, bool verifyTime, std::string &packedStr, std::string &jsonStr) {
+    if (err.size()) throw herr(err);
+    if (!seenEvent) throw herr("event is not an object");
+
+    static const std::pair<Field, const char *> requiredFields[] = {
+        { Field::Id, "id" },
+        { Field::Pubkey, "pubkey" },
+        { Field::CreatedAt, "created_at" },
+        { Field::Kind, "kind" },
+        { Field::Tags, "tags" },
+        { Field::Content, "content" },
+        { Field::Sig, "sig" },
+    };
+
+    for (const auto &[f, name] : requiredFields) {
+        if (!(seenFields & fieldBit(f))) throw herr("event missing field: ", name);
+    }
+
+    tagRefs.clear();
+    std::string_view arena(tagArena);
+
+    for (const auto &t : tagOffsets) {
+        tagRefs.emplace_back(arena.substr(t.nameOffset, t.nameSize), arena.substr(t.valOffset, t.valSize));
+    }
+
+    packedStr = nostrFieldsToPackedEvent(idVal, pubkeyVal, createdAtVal, kindVal, tagRefs);
+    PackedEventView packed(packedStr);
+
+    if (verifyTime) verifyEventTimestamp(packed);
+
+    if (verifyMsg) {
+        hashBuf.clear();
+        hashBuf += "[0,";
+        hashBuf += pubkeyJson;
+        hashBuf += ',';
+        hashBuf += std::to_string(createdAtVal);
+        hashBuf += ',';
+        hashBuf += std::to_string(kindVal);
+        hashBuf += ',';
+        hashBuf += tagsJson;
+        hashBuf += ',';
+        hashBuf += contentJson;
+        hashBuf += ']';
+
+        if (sha256(hashBuf) != Bytes32(packed.id())) throw herr("bad event id");
+    }
+
+    // Same field order as a tao::json object (sorted by key), without any unknown top-level fields
+
+    jsonStr.clear();
+    jsonStr.reserve(100 + contentJson.size() + idJson.size() + pubkeyJson.size() + sigJson.size() + tagsJson.size());
+
+    jsonStr += "{\"content\":";
+    jsonStr += contentJson;
+    jsonStr += ",\"created_at\":";
+    jsonStr += std::to_string(createdAtVal);
+    jsonStr += ",\"id\":";
+    jsonStr += idJson;
+    jsonStr += ",\"kind\":";
+    jsonStr += std::to_string(kindVal);
+    jsonStr += ",\"pubkey\":";
+    jsonStr += pubkeyJson;
+    jsonStr += ",\"sig\":";
+    jsonStr += sigJson;
+    jsonStr += ",\"tags\":";
+    jsonStr += tagsJson;
+    jsonStr += '}';
+
+    if (verifyMsg) verifyNostrEventJsonSize(jsonStr);
+}
+
+
+
+void EventParser::reset(bool wrapped_) {
+    wrapped = wrapped_;
+    depth = 0;
+    eventDepth = wrapped ? 2 : 1;
+    msgElem = 0;
+    tagElem = 0;
+    inEvent = false;
+    inTagsArr = false;
+    tagsHaveObject = false;
+    seenEvent = false;
+    currField = Field::None;
+    seenFields = 0;
+    err.clear();
+
+    idVal.clear();
+    pubkeyVal.clear();
+    sigVal.clear();
+    contentVal.clear();
+    createdAtVal = 0;
+    kindVal = 0;
+
+    tagOffsets.clear();
+    tagArena.clear();
+
+    idJson.clear();
+    pubkeyJson.clear();
+    sigJson.clear();
+    contentJson.clear();
+    tagsJson.clear();
+    tagsFirst = true;
+}
+
+void EventParser::fail(std::string_view msg) {
+    if (err.empty()) err = msg;
+}
+
+void EventParser::tagsNext() {
+    if (!tagsFirst) tagsJson += ',';
+}
+
+// Called for every value that is not a string (or is an array/object) inside the tags array
+
+void EventParser::tagNonString() {
+    if (depth == eventDepth + 1) {
+        fail("tag in tags field was not an array");
+    } else if (depth == eventDepth + 2) {
+        if (tagElem == 0) fail("tag name was not a string");
+        else if (tagElem == 1) fail("tag val was not a string");
+    }
+}
+
+// Returns true if the current value is a member of the event object. Also detects
+// values in positions where the event object was expected.
+
+bool EventParser::atEventMember() {
+    if (inEvent && depth == eventDepth) return true;
+
+    if (depth == 0) {
+        if (wrapped) throw herr("message is not an array");
+        fail("event is not an object");
+    } else if (wrapped && depth == 1) {
+        if (msgElem == 0) throw herr("first element not EVENT");
+        if (msgElem == 1) fail("event is not an object");
+    }
+
+    return false;
+}
+
+void EventParser::badFieldType() {
+    switch (currField) {
+        case Field::Id: fail("event id field was not a string"); break;
+        case Field::Pubkey: fail("event pubkey field was not a string"); break;
+        case Field::CreatedAt: fail("event created_at field was not an integer"); break;
+        case Field::Kind: fail("event kind field was not an integer"); break;
+        case Field::Tags: fail("tags field not an array"); break;
+        case Field::Content: fail("event content field was not a string"); break;
+        case Field::Sig: fail("event sig was not a string"); break;
+        default: break;
+    }
+}
+
+
+
+void EventParser::null() {
+    if (inTags()) {
+        tagsNext();
+        tagsJson += "null";
+        tagNonString();
+    } else if (atEventMember()) {
+        badFieldType();
+    }
+}
+
+void EventParser::boolean(bool v) {
+    if (inTags()) {
+        tagsNext();
+        tagsJson += v ? "true" : "false";
+        tagNonString();
+    } else if (atEventMember()) {
+        badFieldType();
+    }
+}
+
+void EventParser::number(int64_t v) {
+    if (inTags()) {
+        tagsNext();
+        tagsJson += std::to_string(v);
+        tagNonString();
+    } else if (atEventMember()) {
+        badFieldType();
+    }
+}
+
+void EventParser::number(uint64_t v) {
+    if (inTags()) {
+        tagsNext();
+        tagsJson += std::to_string(v);
+        tagNonString();
+    } else if (atEventMember()) {
+        if (currField == Field::CreatedAt) createdAtVal = v;
+        else if (currField == Field::Kind) kindVal = v;
+        else badFieldType();
+    }
+}
+
+void EventParser::number(double v) {
+    if (inTags()) {
+        tagsNext();
+        tagsJson += tao::json::to_string(tao::json::value(v)); // rare, so defer to tao::json for identical formatting
+        tagNonString();
+    } else if (atEventMember()) {
+        badFieldType();
+    }
+}
+
+void EventParser::string(std::string_view v) {
+    if (inTags()) {
+        tagsNext();
+        appendJsonString(tagsJson, v);
+
+        if (depth == eventDepth + 1) {
+            fail("tag in tags field was not an array");
+        } else if (depth == eventDepth + 2 && tagElem < 2) {
+            auto &t = tagOffsets.back();
+
+            if (tagElem == 0) {
+                t.nameOffset = tagArena.size();
+                t.nameSize = v.size();
+            } else {
+                t.valOffset = tagArena.size();
+                t.valSize = v.size();
+            }
+
+            tagArena += v;
+        }
+
+        return;
+    }
+
+    if (wrapped && depth == 1 && msgElem == 0) {
+        if (v != "EVENT") throw herr("first element not EVENT");
+        return;
+    }
+
+    if (!atEventMember()) return;
+
+    switch (currField) {
+        case Field::Id:
+            idVal = v;
+            appendJsonString(idJson, v);
+            break;
+        case Field::Pubkey:
+            pubkeyVal = v;
+            appendJsonString(pubkeyJson, v);
+            break;
+        case Field::Sig:
+            sigVal = v;
+            appendJsonString(sigJson, v);
+            break;
+        case Field::Content:
+            contentVal = v;
+            appendJsonString(contentJson, v);
+            break;
+        default:
+            badFieldType();
+    }
+}
+
+void EventParser::begin_array(size_t) {
+    if (inTags()) {
+        tagsNext();
+        tagsJson += '[';
+        tagsFirst = true;
+
+        if (depth == eventDepth + 1) {
+            tagElem = 0;
+            tagOffsets.push_back({ (uint32_t)tagArena.size(), 0 });
+        } else {
+            tagNonString();
+        }
+    } else if (depth == 0 && wrapped) {
+        // start of client message
+    } else if (atEventMember()) {
+        if (currField == Field::Tags) {
+            inTagsArr = true;
+            tagsJson += '[';
+            tagsFirst = true;
+        } else {
+            badFieldType();
+        }
+    }
+
+    depth++;
+}
+
+void EventParser::element() {
+    if (inTags()) {
+        tagsFirst = false;
+        if (depth == eventDepth + 2) tagElem++;
+    } else if (wrapped && depth == 1) {
+        msgElem++;
+    }
+}
+
+void EventParser::end_array(size_t) {
+    depth--;
+
+    if (inTagsArr && depth >= eventDepth) {
+        tagsJson += ']';
+        if (depth == eventDepth + 1 && tagElem == 0) fail("too few fields in tag");
+    }
+}
+
+void EventParser::begin_object(size_t) {
+    if (inTags()) {
+        tagsNext();
+        tagsJson += '{';
+        tagsFirst = true;
+        tagsHaveObject = true;
+        tagNonString();
+    } else if (!inEvent && !seenEvent && depth == eventDepth - 1 && (!wrapped || msgElem == 1)) {
+        inEvent = true;
+        seenEvent = true;
+    } else if (atEventMember()) {
+        badFieldType();
+    }
+
+    depth++;
+}
+
+void EventParser::key(std::string_view k) {
+    if (inTags()) {
+        tagsNext();
+        appendJsonString(tagsJson, k);
+        tagsJson += ':';
+        tagsFirst = true;
+        return;
+    }
+
+    if (!inEvent || depth != eventDepth) return;
+
+    Field f = Field::Unknown;
+
+    if (k == "id") f = Field::Id;
+    else if (k == "pubkey") f = Field::Pubkey;
+    else if (k == "created_at") f = Field::CreatedAt;
+    else if (k == "kind") f = Field::Kind;
+    else if (k == "tags") f = Field::Tags;
+    else if (k == "content") f = Field::Content;
+    else if (k == "sig") f = Field::Sig;
+
+    if (f != Field::Unknown) {
+        if (seenFields & fieldBit(f)) fail("duplicate JSON object key");
+        seenFields |= fieldBit(f);
+    }
+
+    currField = f;
+}
+
+void EventParser::member() {
+    if (inTags()) {
+        tagsFirst = false;
+    } else if (inEvent && depth == eventDepth) {
+        currField = Field::None;
+        inTagsArr = false;
+    }
+}
+
+void EventParser::end_object(size_t) {
+    depth--;
+
+    if (inTagsArr && depth >= eventDepth) {
+        tagsJson += '}';
+    } else if (inEvent && depth == eventDepth - 1) {
+        inEvent = false;
+    }
+}
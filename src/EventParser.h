@@ -0,0 +1,146 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <secp256k1_schnorrsig.h>
+
+#include "golpe.h"
+
+#include "events.h"
+
+
+// Single-pass parser for incoming events. Instead of building a tao::json DOM, it consumes
+// the parser's events directly and records the canonical serialisation of each event field
+// as it goes. From these fragments it later assembles the NIP-01 hash input and the
+// normalised jsonStr, and the extracted values are used to build the PackedEvent.
+//
+// Buffers are re-used between calls, so a parser should be kept around (one per thread).
+//
+// JSON syntax errors are thrown from parse*(). Semantic errors (missing or invalid fields)
+// are recorded and thrown from verify(), so that callers can still report the event id.
+
+struct EventParser : NonCopyable {
+    // Parses a ["EVENT", {...}] client message
+    void parseMessage(std::string_view msg);
+
+    // Parses a bare event object
+    void parseEvent(std::string_view json);
+
+    // Cheap check that msg starts with ["EVENT", (whitespace allowed)
+    static bool isEventMessage(std::string_view msg);
+
+    // Only valid after a successful parse*()
+
+    std::string_view idHex() const {
+        return (seenFields & fieldBit(Field::Id)) ? std::string_view(idVal) : std::string_view("?");
+    }
+
+    std::string_view content() const {
+        return contentVal;
+    }
+
+    std::string_view sigHex() const {
+        return sigVal;
+    }
+
+    // Checks the fields and builds packedStr/jsonStr. If verifyMsg, also checks the event id and JSON size, but *not* the signature
+    void build(bool verifyMsg, bool verifyTime, std::string &packedStr, std::string &jsonStr);
+
+    // build(), followed by signature verification if verifyMsg
+    void verify(secp256k1_context *secpCtx, bool verifyMsg, bool verifyTime, std::string &packedStr, std::string &jsonStr);
+
+
+    // tao::json events consumer interface
+
+    void null();
+    void boolean(bool v);
+    void number(int64_t v);
+    void number(uint64_t v);
+    void number(double v);
+    void string(std::string_view v);
+
+    void begin_array(size_t = 0);
+    void element();
+    void end_array(size_t = 0);
+
+    void begin_object(size_t = 0);
+    void key(std::string_view k);
+    void member();
+    void end_object(size_t = 0);
+
+
+  private:
+    enum class Field : uint8_t {
+        None,
+        Id,
+        Pubkey,
+        CreatedAt,
+        Kind,
+        Tags,
+        Content,
+        Sig,
+        Unknown,
+    };
+
+    static constexpr uint64_t fieldBit(Field f) {
+        return uint64_t(1) << uint64_t(f);
+    }
+
+    struct TagOffsets {
+        uint32_t nameOffset;
+        uint32_t nameSize;
+        uint32_t valOffset = 0;
+        uint32_t valSize = 0;
+    };
+
+    // Parse state
+
+    bool wrapped = false; // parsing a client message, not a bare event
+    uint64_t depth = 0; // number of currently open arrays/objects
+    uint64_t eventDepth = 0; // depth of the event object's members
+    uint64_t msgElem = 0; // index of current element in the client message array
+    uint64_t tagElem = 0; // index of current element in the current tag
+    bool inEvent = false;
+    bool inTagsArr = false;
+    bool tagsHaveObject = false; // see reserialiseTags()
+    bool seenEvent = false;
+    Field currField = Field::None;
+    uint64_t seenFields = 0;
+    std::string err;
+
+    // Values
+
+    std::string idVal;
+    std::string pubkeyVal;
+    std::string sigVal;
+    std::string contentVal;
+    uint64_t createdAtVal = 0;
+    uint64_t kindVal = 0;
+
+    std::vector<TagOffsets> tagOffsets;
+    std::string tagArena;
+    std::vector<NostrTagRef> tagRefs;
+
+    // Canonical JSON fragments
+
+    std::string idJson;
+    std::string pubkeyJson;
+    std::string sigJson;
+    std::string contentJson;
+    std::string tagsJson;
+    bool tagsFirst = true;
+
+    std::string hashBuf;
+
+
+    void reset(bool wrapped_);
+    void reserialiseTags(std::string_view json);
+    void fail(std::string_view msg);
+    bool inTags() const { return inTagsArr && depth > eventDepth; }
+    void tagsNext();
+    void tagNonString();
+    bool atEventMember();
+    void badFieldType();
+};
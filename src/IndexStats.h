@@ -0,0 +1,218 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <mutex>
+
+#include "golpe.h"
+
+#include "PackedEvent.h"
+
+
+// Approximate number of index entries per pubkey, kind, pubkey+kind, and tag value, used by
+// DBScan to estimate the cost of candidate access paths.
+//
+// Counts are kept in count-min sketches with conservative update (an insert only raises the cells
+// that are below the key's new estimate), so they may over-estimate, but much less for rare keys
+// that share cells with common ones. They never under-estimate, except after deletions.
+//
+// One sketch is filled at startup from a sample of the most recent events, and its counts are scaled
+// up to the size of the DB. Keys seen only a few times in the sample are not scaled: most are rare
+// in the whole DB too, and scaling them by the sampling ratio made the planner avoid their indices.
+// The sample is read on a background thread, and until it is done there are no estimates, so DBScan
+// uses its fixed precedence. Changes committed while it is being read are not counted.
+//
+// The other sketch counts the changes made since then by writeEvents()/deleteEventBasic(). These are
+// held back, per thread, until the caller reports that its write txn committed with commit(), so an
+// aborted txn (after discard()) doesn't leave the counts off. Deletions are subtracted, floored at zero,
+// so deleting events from before the load may leave estimates high. Writes by other processes are not
+// seen until the next load.
+
+struct IndexStats : NonCopyable {
+    ~IndexStats() {
+        stopping = true;
+        if (loadThread.joinable()) loadThread.join();
+    }
+
+    // Starts sampling on a background thread. Does nothing if already started, or if sampleSize is 0
+    void loadInBackground(uint64_t sampleSize) {
+        if (sampleSize == 0 || loadThread.joinable() || loaded) return;
+
+        loadThread = std::thread([this, sampleSize]{
+            setThreadName("IndexStats");
+
+            try {
+                auto txn = env.txn_ro();
+                load(txn, sampleSize);
+            } catch (std::exception &e) {
+                LE << "Couldn't sample index stats: " << e.what();
+            }
+        });
+    }
+
+    // Samples on the calling thread. Does nothing if already loaded, or if sampleSize is 0
+    void load(lmdb::txn &txn, uint64_t sampleSize) {
+        if (sampleSize == 0 || loaded) return;
+
+        uint64_t total = env.dbi_Event__id.stat(txn).ms_entries;
+        uint64_t sampled = 0;
+
+        env.foreach_Event(txn, [&](auto &ev){
+            update(sampleCells, PackedEventView(ev.buf), 1);
+            return ++sampled < sampleSize && !stopping;
+        }, true);
+
+        if (stopping) return;
+
+        sampleWeight = sampled ? double(total) / sampled : 1;
+        numEvents = total;
+        loaded = true;
+
+        LI << "Index stats: sampled " << sampled << " of " << total << " events";
+    }
+
+    bool isLoaded() const {
+        return loaded;
+    }
+
+    // Called in a write txn. Held back until commit()
+
+    void add(PackedEventView ev) {
+        if (!loaded) return;
+        pending.emplace_back(std::string(ev.buf), 1);
+    }
+
+    void remove(PackedEventView ev) {
+        if (!loaded) return;
+        pending.emplace_back(std::string(ev.buf), -1);
+    }
+
+    // Applies the changes made by this thread, once its write txn has committed
+    void commit() {
+        if (pending.empty()) return;
+
+        std::unique_lock<std::mutex> lk(commitMutex);
+
+        for (auto &[packedStr, delta] : pending) {
+            update(cells, PackedEventView(packedStr), delta);
+            if (delta > 0) numEvents++;
+            else if (numEvents) numEvents--;
+        }
+
+        pending.clear();
+    }
+
+    // Drops the changes made by this thread, after its write txn was aborted
+    void discard() {
+        pending.clear();
+    }
+
+    uint64_t total() const {
+        return numEvents;
+    }
+
+    uint64_t pubkey(std::string_view pubkey) const {
+        return estimate(Type::Pubkey, pubkey);
+    }
+
+    uint64_t kind(uint64_t kind) const {
+        return estimate(Type::Kind, lmdb::to_sv<uint64_t>(kind));
+    }
+
+    uint64_t pubkeyKind(std::string_view pubkey, uint64_t kind) const {
+        return estimate(Type::PubkeyKind, std::string(pubkey) + std::string(lmdb::to_sv<uint64_t>(kind)));
+    }
+
+    uint64_t tag(char tagName, std::string_view tagVal) const {
+        return estimate(Type::Tag, std::string(1, tagName) + std::string(tagVal));
+    }
+
+  private:
+    static constexpr uint64_t Depth = 4;
+    static constexpr uint64_t Width = 1 << 17;
+    static constexpr uint64_t MinScaledCount = 8; // sample counts up to this are taken as they are
+
+    enum class Type : char {
+        Pubkey = 'P',
+        Kind = 'K',
+        PubkeyKind = 'B',
+        Tag = 'T',
+    };
+
+    using Cells = std::vector<std::atomic<uint32_t>>;
+
+    Cells sampleCells = Cells(Depth * Width); // only written by load()
+    Cells cells = Cells(Depth * Width); // changes since load()
+    double sampleWeight = 1;
+    std::atomic<uint64_t> numEvents = 0;
+    std::atomic<bool> loaded = false;
+    std::atomic<bool> stopping = false; // abandon sampling in progress, so exiting isn't held up by it
+    std::thread loadThread;
+    std::mutex commitMutex;
+
+    static inline thread_local std::vector<std::pair<std::string, int64_t>> pending; // packed event, delta
+
+    template <typename F>
+    static void foreachCell(Type type, std::string_view key, F cb) {
+        uint64_t h1 = std::hash<std::string_view>{}(key) ^ (uint64_t(type) * 0x9E3779B97F4A7C15ULL);
+        uint64_t h2 = (h1 * 0xBF58476D1CE4E5B9ULL) ^ (h1 >> 31);
+        h2 |= 1;
+
+        for (uint64_t i = 0; i < Depth; i++) {
+            cb(i * Width + ((h1 + i * h2) % Width));
+        }
+    }
+
+    static uint64_t sketchEstimate(const Cells &cs, Type type, std::string_view key) {
+        uint64_t output = MAX_U64;
+        foreachCell(type, key, [&](uint64_t c){
+            output = std::min(output, uint64_t(cs[c].load(std::memory_order_relaxed)));
+        });
+        return output;
+    }
+
+    // Only called from one thread at a time: by load() for sampleCells, and with commitMutex held for cells
+    static void bump(Cells &cs, Type type, std::string_view key, int64_t delta) {
+        if (delta >= 0) {
+            uint32_t target = uint32_t(std::min(sketchEstimate(cs, type, key) + uint64_t(delta), uint64_t(UINT32_MAX)));
+
+            foreachCell(type, key, [&](uint64_t c){
+                if (cs[c].load(std::memory_order_relaxed) < target) cs[c].store(target, std::memory_order_relaxed);
+            });
+        } else {
+            uint32_t dec = uint32_t(-delta);
+
+            foreachCell(type, key, [&](uint64_t c){
+                uint32_t curr = cs[c].load(std::memory_order_relaxed);
+                cs[c].store(curr > dec ? curr - dec : 0, std::memory_order_relaxed);
+            });
+        }
+    }
+
+    uint64_t estimate(Type type, std::string_view key) const {
+        uint64_t sampleCount = sketchEstimate(sampleCells, type, key);
+        uint64_t scaled = std::min(sampleCount, MinScaledCount);
+        if (sampleCount > MinScaledCount) scaled += uint64_t((sampleCount - MinScaledCount) * sampleWeight);
+
+        return scaled + sketchEstimate(cells, type, key);
+    }
+
+    static void update(Cells &cs, PackedEventView ev, int64_t delta) {
+        bump(cs, Type::Pubkey, ev.pubkey(), delta);
+        bump(cs, Type::Kind, lmdb::to_sv<uint64_t>(ev.kind()), delta);
+        bump(cs, Type::PubkeyKind, std::string(ev.pubkey()) + std::string(lmdb::to_sv<uint64_t>(ev.kind())), delta);
+
+        std::string tagKey;
+
+        ev.foreachTag([&](char tagName, std::string_view tagVal){
+            tagKey.clear();
+            tagKey += tagName;
+            tagKey += tagVal;
+            bump(cs, Type::Tag, tagKey, delta);
+            return true;
+        });
+    }
+};
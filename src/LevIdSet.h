@@ -0,0 +1,92 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+
+#include "golpe.h"
+
+
+// Set of levIds, used by DBQuery to avoid sending an event twice.
+//
+// Stored like a roaring bitmap: levIds are grouped by their upper 48 bits, and each group holds the
+// lower 16 bits either in a sorted array while small, or in an 8 KiB bitmap once the array would be
+// larger than that. levIds are assigned sequentially, so the events matched by a big query are
+// clustered into relatively few groups, and take 2 bytes (or less) each rather than the 16+ of a hash
+// set entry.
+
+struct LevIdSet : NonCopyable {
+    // Returns true if levId was not already present
+    bool insert(uint64_t levId) {
+        auto &c = container(levId >> 16);
+        uint16_t low = uint16_t(levId);
+
+        if (c.bitmap.size()) {
+            uint64_t &word = c.bitmap[low >> 6];
+            uint64_t bit = uint64_t(1) << (low & 63);
+            if (word & bit) return false;
+            word |= bit;
+        } else {
+            auto it = std::lower_bound(c.array.begin(), c.array.end(), low);
+            if (it != c.array.end() && *it == low) return false;
+            c.array.insert(it, low);
+            if (c.array.size() > MaxArraySize) c.convertToBitmap();
+        }
+
+        numItems++;
+        return true;
+    }
+
+    bool contains(uint64_t levId) const {
+        auto it = containers.find(levId >> 16);
+        if (it == containers.end()) return false;
+
+        const auto &c = it->second;
+        uint16_t low = uint16_t(levId);
+
+        if (c.bitmap.size()) return c.bitmap[low >> 6] & (uint64_t(1) << (low & 63));
+        return std::binary_search(c.array.begin(), c.array.end(), low);
+    }
+
+    uint64_t size() const {
+        return numItems;
+    }
+
+    void clear() {
+        containers.clear();
+        last = nullptr;
+        numItems = 0;
+    }
+
+  private:
+    static constexpr size_t MaxArraySize = 4096; // 8 KiB, the same as a bitmap
+
+    struct Container {
+        std::vector<uint16_t> array; // sorted
+        std::vector<uint64_t> bitmap; // empty unless converted
+
+        void convertToBitmap() {
+            bitmap.resize(65536 / 64);
+            for (auto low : array) bitmap[low >> 6] |= uint64_t(1) << (low & 63);
+            array.clear();
+            array.shrink_to_fit();
+        }
+    };
+
+    flat_hash_map<uint64_t, Container> containers;
+    uint64_t numItems = 0;
+
+    // Consecutive inserts usually land in the same container
+    uint64_t lastKey = 0;
+    Container *last = nullptr;
+
+    Container &container(uint64_t key) {
+        if (last && lastKey == key) return *last;
+
+        auto it = containers.find(key);
+        if (it == containers.end()) it = containers.try_emplace(key).first; // may rehash, invalidating last
+
+        lastKey = key;
+        last = &it->second;
+        return *last;
+    }
+};
@@ -0,0 +1,155 @@
+#pragma once
+
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <algorithm>
+
+#include "golpe.h"
+
+#include "events.h"
+
+
+// New events, shared by the ReqMonitor threads.
+//
+// Subscriptions are partitioned over the ReqMonitor threads by connId, so after every DB change each
+// thread must match the new events against its own ActiveMonitors. Rather than every thread reading
+// the new events from the DB, and each decompressing the JSON of those that matched one of its
+// subscriptions, the first thread to see an event copies it here, and its JSON is decompressed once,
+// by whichever thread first needs it. What remains per-thread is probing its ActiveMonitors, which
+// only holds that thread's share of the subscriptions.
+//
+// Events are kept until every thread has consumed them, up to MaxEvents. A thread that falls further
+// behind than that reads the older events from the DB itself.
+//
+// The lock is only held to claim a range of new events and later to publish them: the claiming thread
+// reads them from the DB without it. Meanwhile other threads can still take the events already
+// published, and only threads that need the claimed range wait for it.
+
+struct NewEventFeed : NonCopyable {
+    struct Event : NonCopyable {
+        uint64_t levId;
+        std::string packed;
+
+        Event(uint64_t levId, std::string_view packed) : levId(levId), packed(packed) {}
+
+        // Decompressed on first use. Empty if the event was deleted before then
+        std::string_view json(lmdb::txn &txn, Decompressor &decomp) {
+            std::call_once(jsonOnce, [&]{
+                std::string_view payload;
+                if (env.dbi_EventPayload.get(txn, lmdb::to_sv<uint64_t>(levId), payload)) {
+                    jsonBuf = getEventJson(txn, decomp, levId, payload);
+                }
+            });
+
+            return jsonBuf;
+        }
+
+      private:
+        std::once_flag jsonOnce;
+        std::string jsonBuf;
+    };
+
+    void init(uint64_t numConsumers) {
+        consumed.assign(numConsumers, 0);
+    }
+
+    // Calls cb(Event &) in order for each event with a levId in (after, latest], where latest is the
+    // most recent levId in txn. consumer is the calling thread's id.
+    template <typename F>
+    void foreachNew(lmdb::txn &txn, uint64_t consumer, uint64_t after, uint64_t latest, F cb) {
+        std::vector<std::shared_ptr<Event>> batch;
+        uint64_t readFromDbUntil = after;
+
+        {
+            std::unique_lock<std::mutex> lk(mutex);
+
+            if (!started) {
+                base = top = after;
+                started = true;
+            }
+
+            while (latest > top) {
+                if (filling) {
+                    filled.wait(lk);
+                    continue;
+                }
+
+                if (latest - top > MaxEvents) {
+                    // Too many to keep (ie an import): everyone reads these from the DB
+                    events.clear();
+                    base = top = latest;
+                    break;
+                }
+
+                // Claim (top, latest], and read it without holding the lock
+
+                uint64_t from = top + 1;
+                filling = true;
+                lk.unlock();
+
+                std::vector<std::shared_ptr<Event>> newEvents;
+
+                try {
+                    env.foreach_Event(txn, [&](auto &ev){
+                        if (ev.primaryKeyId > latest) return false;
+                        newEvents.push_back(std::make_shared<Event>(ev.primaryKeyId, ev.buf));
+                        return true;
+                    }, false, from);
+                } catch (...) {
+                    lk.lock();
+                    filling = false;
+                    filled.notify_all();
+                    throw;
+                }
+
+                lk.lock();
+                for (auto &e : newEvents) events.push_back(std::move(e));
+                top = latest;
+                filling = false;
+                filled.notify_all();
+            }
+
+            if (after < base) readFromDbUntil = std::min(base, latest);
+
+            auto it = std::upper_bound(events.begin(), events.end(), after, [](uint64_t levId, const auto &e){ return levId < e->levId; });
+            for (; it != events.end() && (*it)->levId <= latest; ++it) batch.push_back(*it);
+
+            consumed.at(consumer) = latest;
+            trim();
+        }
+
+        if (readFromDbUntil > after) {
+            env.foreach_Event(txn, [&](auto &ev){
+                if (ev.primaryKeyId > readFromDbUntil) return false;
+                Event e(ev.primaryKeyId, ev.buf);
+                cb(e);
+                return true;
+            }, false, after + 1);
+        }
+
+        for (auto &e : batch) cb(*e);
+    }
+
+  private:
+    static constexpr size_t MaxEvents = 10'000;
+
+    std::mutex mutex;
+    std::condition_variable filled;
+    std::deque<std::shared_ptr<Event>> events; // all events with levIds in (base, top], ascending
+    uint64_t base = 0;
+    uint64_t top = 0;
+    bool started = false;
+    bool filling = false; // a thread is reading the events after top from the DB
+    std::vector<uint64_t> consumed; // consumer -> latest levId it has processed
+
+    void trim() {
+        uint64_t minConsumed = *std::min_element(consumed.begin(), consumed.end());
+
+        while (events.size() && (events.front()->levId <= minConsumed || events.size() > MaxEvents)) {
+            base = events.front()->levId;
+            events.pop_front();
+        }
+    }
+};
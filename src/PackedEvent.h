@@ -49,7 +49,9 @@ struct PackedEventView {
         return lmdb::from_sv<uint64_t>(buf.substr(80, 8));
     }
 
-    void foreachTag(const std::function<bool(char, std::string_view)> &cb) const {
+    // cb(char tagName, std::string_view tagVal) returns false to stop
+    template <typename F>
+    void foreachTag(F cb) const {
         std::string_view b = buf.substr(88);
 
         while (b.size() >= 2) {
@@ -105,6 +105,16 @@ public:
     Counter writeTimeUs;  // total microseconds spent in write transactions
     Gauge lastWriteBatchSize;
 
+    // Query metrics
+    Counter coalescedQueriesTotal;
+    Counter abortedQueriesTotal;
+    Counter materialisedCountsTotal;
+    Counter queryCacheHitsTotal;
+    Counter queryCacheMissesTotal;
+    Counter queryCacheInvalidationsTotal;
+    Gauge queryCacheEntries;
+    Gauge queryCacheBytes;
+
     // Connection tracking
     Gauge activeConnections;
     Counter slowClientTerminations;
@@ -164,6 +174,39 @@ public:
         out << "# TYPE strfry_write_batch_size gauge\n";
         out << "strfry_write_batch_size " << lastWriteBatchSize.get() << "\n";
 
+        // Query metrics
+        out << "# HELP strfry_queries_coalesced_total REQs that joined an identical running DB scan instead of starting their own\n";
+        out << "# TYPE strfry_queries_coalesced_total counter\n";
+        out << "strfry_queries_coalesced_total " << coalescedQueriesTotal.get() << "\n";
+
+        out << "# HELP strfry_queries_aborted_total REQs closed for exceeding relay.maxQueryTimeMilliseconds or relay.maxQueryEvents\n";
+        out << "# TYPE strfry_queries_aborted_total counter\n";
+        out << "strfry_queries_aborted_total " << abortedQueriesTotal.get() << "\n";
+
+        out << "# HELP strfry_counts_materialised_total COUNTs answered from the materialised event counts instead of a DB scan\n";
+        out << "# TYPE strfry_counts_materialised_total counter\n";
+        out << "strfry_counts_materialised_total " << materialisedCountsTotal.get() << "\n";
+
+        out << "# HELP strfry_query_cache_hits_total REQs answered from the query result cache\n";
+        out << "# TYPE strfry_query_cache_hits_total counter\n";
+        out << "strfry_query_cache_hits_total " << queryCacheHitsTotal.get() << "\n";
+
+        out << "# HELP strfry_query_cache_misses_total REQs that were not in the query result cache and needed a DB scan\n";
+        out << "# TYPE strfry_query_cache_misses_total counter\n";
+        out << "strfry_query_cache_misses_total " << queryCacheMissesTotal.get() << "\n";
+
+        out << "# HELP strfry_query_cache_invalidations_total Query result cache entries dropped because a cached event was deleted\n";
+        out << "# TYPE strfry_query_cache_invalidations_total counter\n";
+        out << "strfry_query_cache_invalidations_total " << queryCacheInvalidationsTotal.get() << "\n";
+
+        out << "# HELP strfry_query_cache_entries Current number of entries in the query result caches\n";
+        out << "# TYPE strfry_query_cache_entries gauge\n";
+        out << "strfry_query_cache_entries " << queryCacheEntries.get() << "\n";
+
+        out << "# HELP strfry_query_cache_bytes Approximate memory used by the query result caches\n";
+        out << "# TYPE strfry_query_cache_bytes gauge\n";
+        out << "strfry_query_cache_bytes " << queryCacheBytes.get() << "\n";
+
         // Connection tracking
         out << "# HELP strfry_connections_current Current number of active WebSocket connections\n";
         out << "# TYPE strfry_connections_current gauge\n";
@@ -0,0 +1,50 @@
+#include "golpe.h"
+
+#include "PubkeyIds.h"
+
+
+thread_local lmdb::txn *PubkeyIds::currTxn = nullptr;
+
+
+PubkeyIds::Scope::Scope(lmdb::txn &txn) : prev(currTxn) {
+    currTxn = &txn;
+}
+
+PubkeyIds::Scope::~Scope() {
+    currTxn = prev;
+}
+
+std::string PubkeyIds::indexKey(std::string_view pubkey) {
+    if (!currTxn) throw herr("pubkey id needed outside of PubkeyIds::Scope");
+    auto &txn = *currTxn;
+
+    if (auto id = lookup(txn, pubkey)) return *id;
+
+    uint64_t next = env.dbi_Pubkey.stat(txn).ms_entries + 1;
+    if (next > UINT32_MAX) throw herr("too many pubkeys");
+
+    std::string id(lmdb::to_sv<uint32_t>(uint32_t(next)));
+    env.dbi_Pubkey.put(txn, pubkey, id);
+    return id;
+}
+
+std::string PubkeyIds::indexTagKey(char tagName, std::string_view tagVal) {
+    if (tagName == 'p' && tagVal.size() == 32) return std::string(1, tagName) + indexKey(tagVal);
+    return std::string(1, tagName) + std::string(tagVal);
+}
+
+std::optional<std::string> PubkeyIds::lookup(lmdb::txn &txn, std::string_view pubkey) {
+    std::string_view v;
+    if (!env.dbi_Pubkey.get(txn, pubkey, v)) return std::nullopt;
+    return std::string(v);
+}
+
+std::optional<std::string> PubkeyIds::lookupTagKey(lmdb::txn &txn, char tagName, std::string_view tagVal) {
+    if (tagName == 'p' && tagVal.size() == 32) {
+        auto id = lookup(txn, tagVal);
+        if (!id) return std::nullopt;
+        return std::string(1, tagName) + *id;
+    }
+
+    return std::string(1, tagName) + std::string(tagVal);
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <optional>
+
+#include "golpe.h"
+
+
+// Interned pubkeys. The pubkey, pubkeyKind, and p-tag entries of the tag and tagKind indices are keyed
+// by a dense 4 byte id instead of the 32 byte pubkey, which makes these B-trees several times smaller.
+// Ids are allocated in the Pubkey table the first time a pubkey is indexed, and never change.
+//
+// Index keys are computed by the indexPrelude in golpe.yaml, which only has access to the record. So
+// while inserting or deleting events, the writer makes its txn available with a Scope, and the prelude
+// looks up (and if necessary allocates) ids through it. Events themselves still store full pubkeys.
+
+struct PubkeyIds {
+    struct Scope : NonCopyable {
+        Scope(lmdb::txn &txn);
+        ~Scope();
+
+      private:
+        lmdb::txn *prev;
+    };
+
+    // For the indexPrelude: the id of pubkey, allocated if necessary
+    static std::string indexKey(std::string_view pubkey);
+
+    // For the indexPrelude: tag name followed by tag value, with p-tag pubkeys replaced by their ids
+    static std::string indexTagKey(char tagName, std::string_view tagVal);
+
+    // For queries: as above, but nullopt if the pubkey has never been indexed (so nothing can match)
+    static std::optional<std::string> lookup(lmdb::txn &txn, std::string_view pubkey);
+    static std::optional<std::string> lookupTagKey(lmdb::txn &txn, char tagName, std::string_view tagVal);
+
+  private:
+    static thread_local lmdb::txn *currTxn;
+};
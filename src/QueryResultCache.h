@@ -0,0 +1,99 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <list>
+
+#include "golpe.h"
+
+#include "DBQuery.h"
+#include "PrometheusMetrics.h"
+
+
+// LRU cache of the results of completed queries, keyed by canonical filter group. Used by
+// QueryScheduler so that popular filters re-run by many clients don't each need a full DB scan.
+//
+// An entry holds, for each filter in the group, the events its scan found (in scan order, so
+// created_at descending) as of latestEventId. That is enough to rebuild the response at any later
+// levId: events stored since then are matched directly and merged in, and the filter limits applied
+// again. If a cached event has since been deleted, the event that would replace it is unknown, so
+// the entry must be dropped and the query scanned again.
+
+struct QueryResultCache : NonCopyable {
+    struct Entry {
+        uint64_t latestEventId = 0;
+        std::vector<std::vector<DBQuery::FoundEvent>> filterResults;
+    };
+
+    ~QueryResultCache() {
+        clear();
+    }
+
+    // Returns nullptr if not found. Pointer is valid until the next put()/erase()/clear()
+    Entry *find(const std::string &key) {
+        auto it = index.find(key);
+        if (it == index.end()) return nullptr;
+
+        lru.splice(lru.begin(), lru, it->second);
+        return &it->second->entry;
+    }
+
+    // Replaces any existing entry, and then evicts least recently used entries until within maxBytes
+    void put(const std::string &key, Entry &&entry, uint64_t maxBytes) {
+        erase(key);
+
+        uint64_t bytes = entrySize(key, entry);
+        if (bytes > maxBytes / 4) return; // don't let one huge result flush everything else
+
+        lru.emplace_front(Node{ key, std::move(entry), bytes });
+        index.emplace(key, lru.begin());
+        account(1, int64_t(bytes));
+
+        while (currBytes > maxBytes) {
+            auto &last = lru.back();
+            index.erase(last.key);
+            account(-1, -int64_t(last.bytes));
+            lru.pop_back();
+        }
+    }
+
+    void erase(const std::string &key) {
+        auto it = index.find(key);
+        if (it == index.end()) return;
+
+        account(-1, -int64_t(it->second->bytes));
+        lru.erase(it->second);
+        index.erase(it);
+    }
+
+    void clear() {
+        account(-int64_t(lru.size()), -int64_t(currBytes));
+        lru.clear();
+        index.clear();
+    }
+
+  private:
+    struct Node {
+        std::string key;
+        Entry entry;
+        uint64_t bytes;
+    };
+
+    std::list<Node> lru; // most recently used first
+    flat_hash_map<std::string, std::list<Node>::iterator> index;
+    uint64_t currBytes = 0;
+
+    static uint64_t entrySize(const std::string &key, const Entry &entry) {
+        uint64_t bytes = sizeof(Node) + 2 * key.size() + 64; // key is stored twice, plus list/map overhead
+        for (const auto &r : entry.filterResults) bytes += sizeof(r) + r.size() * sizeof(DBQuery::FoundEvent);
+        return bytes;
+    }
+
+    void account(int64_t entries, int64_t bytes) {
+        currBytes += bytes;
+
+        auto &metrics = PrometheusMetrics::getInstance();
+        metrics.queryCacheEntries.inc(entries);
+        metrics.queryCacheBytes.inc(bytes);
+    }
+};
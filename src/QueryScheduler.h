@@ -1,25 +1,113 @@
 #pragma once
 
+#include <cmath>
+#include <queue>
+
 #include "DBQuery.h"
+#include "QueryResultCache.h"
+#include "PrometheusMetrics.h"
 
 
 struct QueryScheduler : NonCopyable {
     std::function<void(lmdb::txn &txn, const Subscription &sub, uint64_t levId, std::string_view eventPayload)> onEvent;
     std::function<void(lmdb::txn &txn, const Subscription &sub, const std::vector<uint64_t> &levIds)> onEventBatch;
     std::function<void(lmdb::txn &txn, Subscription &sub, uint64_t total)> onComplete;
+    std::function<void(lmdb::txn &txn, Subscription &sub, std::string_view reason)> onAbort; // a query limit was exceeded
+
+    // Called when a query has been paused while others are waiting. If it returns true, then the query has been
+    // handed to another thread, which may run it with runSlice() and must then give it back with adopt(). Until
+    // then, this scheduler only ever sets its dead flag.
+    std::function<bool(DBQuery *q)> onLend;
 
     // If false, then levIds returned to above callbacks can be stale (because they were deleted)
     // If false, then onEvent's eventPayload will always be ""
     bool ensureExists = true;
 
+    // If true, a new subscription whose filter group is identical to that of a running query joins it
+    // as a follower instead of starting its own scan. It is first sent the events already found, and
+    // then receives the rest along with the other subscribers. Its latestEventId is set to the running
+    // query's, so events newer than that are left for the ReqMonitor, as usual.
+    bool coalesce = false;
+
+    // If non-zero, the results of completed queries are kept in an LRU cache of up to this many bytes.
+    // A new subscription whose filter group is in the cache is answered from it, after merging in any
+    // matching events stored since the entry was computed, without scanning the indices. Matching those
+    // events is time-sliced and scheduled like a scan, see runTopUp().
+    uint64_t cacheBytes = 0;
+
+    // If set, DB scans of wide filters read their cursors in parallel on this pool
+    ScanPool *scanPool = nullptr;
+
+    // If non-zero (and scanPool is set), events found by a scan are held back until this many have been
+    // found, and then paged in together on the scanPool threads before being sent. See ScanPool::prefetch()
+    uint64_t prefetchWindow = 0;
+
+    // Limits on the DB scan of a single subscription, across all its filters (0 for no limit). When one
+    // is exceeded, the scan is stopped and onAbort is called instead of onComplete.
+    uint64_t maxQueryTimeMicroseconds = 0;
+    uint64_t maxQueryEvents = 0;
+
     using ConnQueries = flat_hash_map<SubId, DBQuery*>;
     flat_hash_map<uint64_t, ConnQueries> conns; // connId -> subId -> DBQuery*
-    std::deque<DBQuery*> running;
+    flat_hash_map<std::string, DBQuery*> byFilter; // canonical filter group -> running DBQuery (only if coalesce)
+
+    // Queries waiting for a time slice, soonest deadline first. See enqueue()
+    struct Queued {
+        double deadline;
+        DBQuery *q;
+
+        bool operator<(const Queued &o) const {
+            return deadline > o.deadline;
+        }
+    };
+
+    std::priority_queue<Queued> running;
     std::vector<uint64_t> levIdBatch;
+    std::vector<uint64_t> prefetchBatch;
+    QueryResultCache cache;
+
+    // Recent scan time used per connection and per IP, for scheduling. See takeNext()
+
+    struct Usage {
+        static constexpr double HalfLife = 1'000'000; // microseconds
+
+        double time = 0; // microseconds, decaying with HalfLife
+        uint64_t updated = 0;
+
+        double get(uint64_t now) const {
+            return time * std::exp2(-double(now - updated) / HalfLife);
+        }
+
+        void add(uint64_t now, uint64_t t) {
+            time = get(now) + t;
+            updated = now;
+        }
+    };
+
+    struct ConnUsage {
+        Usage usage;
+        std::string ipAddr;
+    };
 
-    bool addSub(lmdb::txn &txn, Subscription &&sub) {
+    struct IpUsage {
+        Usage usage;
+        uint64_t numConns = 0;
+    };
+
+    flat_hash_map<uint64_t, ConnUsage> connUsage;
+    flat_hash_map<std::string, IpUsage> ipUsage;
+
+    bool addSub(lmdb::txn &txn, Subscription &&sub, std::string_view ipAddr = "") {
         sub.latestEventId = getMostRecentLevId(txn);
 
+        if (ipAddr.size()) {
+            auto res = connUsage.try_emplace(sub.connId);
+            if (res.second) {
+                res.first->second.ipAddr = ipAddr;
+                ipUsage[res.first->second.ipAddr].numConns++;
+            }
+        }
+
         {
             auto *existing = findQuery(sub.connId, sub.subId);
             if (existing) removeSub(sub.connId, sub.subId);
@@ -32,10 +120,53 @@ struct QueryScheduler : NonCopyable {
             return false;
         }
 
+        std::string filterKey;
+
+        if (coalesce || cacheBytes) {
+            filterKey = sub.filterGroup.canonical();
+            filterKey += sub.countOnly ? 'C' : 'R';
+        }
+
+        if (coalesce) {
+            auto it = byFilter.find(filterKey);
+            if (it != byFilter.end()) {
+                DBQuery *q = it->second;
+
+                sub.latestEventId = q->sub.latestEventId;
+                connQueries.try_emplace(sub.subId, q);
+                auto &follower = q->followers.emplace_back(std::move(sub));
+                PrometheusMetrics::getInstance().coalescedQueriesTotal.inc();
+
+                if (q->sentEventsOrdered.size()) {
+                    auto eventPayloadCursor = lmdb::cursor::open(txn, env.dbi_EventPayload);
+                    for (auto levId : q->sentEventsOrdered) emitEvent(txn, eventPayloadCursor, follower, levId);
+                    flushBatch(txn, follower);
+                }
+
+                return true;
+            }
+        }
+
+        if (!cacheBytes) cache.clear();
+
         DBQuery *q = new DBQuery(sub);
+        q->scanPool = scanPool;
+        if (maxQueryEvents) q->maxEvents = maxQueryEvents;
 
         connQueries.try_emplace(q->sub.subId, q);
-        running.push_front(q);
+        enqueue(q);
+
+        q->filterKey = std::move(filterKey);
+
+        if (coalesce) {
+            q->recordSent = true;
+            byFilter.emplace(q->filterKey, q);
+        }
+
+        if (cacheBytes) {
+            q->recordResults = true;
+            startFromCache(q);
+        }
 
         return true;
     }
@@ -53,59 +184,358 @@ struct QueryScheduler : NonCopyable {
     void removeSub(uint64_t connId, const SubId &subId) {
         auto *query = findQuery(connId, subId);
         if (!query) return;
-        query->dead = true;
+        detach(query, connId, subId);
         conns[connId].erase(subId);
         if (conns[connId].empty()) conns.erase(connId);
     }
 
     void closeConn(uint64_t connId) {
+        if (auto it = connUsage.find(connId); it != connUsage.end()) {
+            auto ip = ipUsage.find(it->second.ipAddr);
+            if (ip != ipUsage.end() && --ip->second.numConns == 0) ipUsage.erase(ip);
+            connUsage.erase(it);
+        }
+
         auto f1 = conns.find(connId);
         if (f1 == conns.end()) return;
 
-        for (auto &[k, v] : f1->second) v->dead = true;
+        for (auto &[k, v] : f1->second) detach(v, connId, k);
 
         conns.erase(connId);
     }
 
     void process(lmdb::txn &txn) {
-        if (running.empty()) return;
+        DBQuery *q = takeNext();
+        if (!q) return;
+
+        bool complete = runSlice(txn, q);
+        settle(txn, q, complete, true);
+    }
+
+    // Runs one time slice of a query's scan. Returns true if the scan is complete.
+    // Can be used to run queries lent by another thread's scheduler (see onLend)
+    bool runSlice(lmdb::txn &txn, DBQuery *q) {
+        if (q->topUp) return runTopUp(txn, q);
+
+        auto eventPayloadCursor = lmdb::cursor::open(txn, env.dbi_EventPayload);
+
+        auto emitAll = [&](uint64_t levId){
+            if (q->dead) return; // lent queries can be cancelled by their owner at any time
+            emitEvent(txn, eventPayloadCursor, q->sub, levId);
+            for (const auto &follower : q->followers) emitEvent(txn, eventPayloadCursor, follower, levId);
+        };
+
+        auto flushPrefetch = [&]{
+            scanPool->prefetch(txn, prefetchBatch);
+            for (auto levId : prefetchBatch) emitAll(levId);
+            prefetchBatch.clear();
+        };
 
-        DBQuery *q = running.front();
-        running.pop_front();
+        bool usePrefetch = usePrefetchFor(q->sub);
 
+        bool complete = q->process(txn, [&](const auto &, uint64_t levId){
+            if (!usePrefetch) {
+                emitAll(levId);
+                return;
+            }
+
+            prefetchBatch.push_back(levId);
+            if (prefetchBatch.size() >= prefetchWindow) flushPrefetch();
+        }, cfg().relay__queryTimesliceBudgetMicroseconds, cfg().relay__logging__dbScanPerf);
+
+        if (usePrefetch) flushPrefetch();
+
+        flushBatch(txn, q->sub);
+        for (const auto &follower : q->followers) flushBatch(txn, follower);
+
+        return complete;
+    }
+
+    bool overBudget(DBQuery *q) const {
+        return maxQueryTimeMicroseconds && q->usedTime() > maxQueryTimeMicroseconds;
+    }
+
+    // Takes back a query that was lent with onLend, once the borrowing thread is done with it
+    void adopt(lmdb::txn &txn, DBQuery *q, bool complete) {
         if (q->dead) {
             delete q;
             return;
         }
 
-        auto eventPayloadCursor = lmdb::cursor::open(txn, env.dbi_EventPayload);
+        if (coalesce) byFilter.try_emplace(q->filterKey, q);
+        settle(txn, q, complete, false);
+    }
 
-        bool complete = q->process(txn, [&](const auto &sub, uint64_t levId){
-            std::string_view eventPayload;
+  private:
+    bool usePrefetchFor(const Subscription &sub) const {
+        return prefetchWindow && ensureExists && !sub.countOnly && scanPool && scanPool->enabled();
+    }
 
-            if (ensureExists) {
-                std::string_view key = lmdb::to_sv<uint64_t>(levId);
-                if (!eventPayloadCursor.get(key, eventPayload, MDB_SET_KEY)) return; // If not found, was deleted while scan was paused
-            }
+    void emitEvent(lmdb::txn &txn, lmdb::cursor &eventPayloadCursor, const Subscription &sub, uint64_t levId) {
+        std::string_view eventPayload;
 
-            if (onEvent) onEvent(txn, sub, levId, eventPayload);
-            if (onEventBatch) levIdBatch.push_back(levId);
-        }, cfg().relay__queryTimesliceBudgetMicroseconds, cfg().relay__logging__dbScanPerf);
+        if (ensureExists) {
+            std::string_view key = lmdb::to_sv<uint64_t>(levId);
+            if (!eventPayloadCursor.get(key, eventPayload, MDB_SET_KEY)) return; // If not found, was deleted while scan was paused
+        }
+
+        if (onEvent) onEvent(txn, sub, levId, eventPayload);
+        if (onEventBatch) levIdBatch.push_back(levId);
+    }
 
+    void flushBatch(lmdb::txn &txn, const Subscription &sub) {
         if (onEventBatch) {
-            onEventBatch(txn, q->sub, levIdBatch);
+            onEventBatch(txn, sub, levIdBatch);
             levIdBatch.clear();
         }
+    }
+
+    // Removes one subscriber from a query. The query only dies once it has no subscribers left
+    void detach(DBQuery *q, uint64_t connId, const SubId &subId) {
+        if (q->sub.connId == connId && q->sub.subId == subId) {
+            if (q->followers.empty()) {
+                q->dead = true;
+                forgetFilter(q);
+                return;
+            }
 
-        if (complete) {
-            auto connId = q->sub.connId;
-            removeSub(connId, q->sub.subId);
+            // Promote a follower: filters are identical, so only its identity needs to be taken over
 
-            if (onComplete) onComplete(txn, q->sub, q->sentEventsFull.size());
+            auto &follower = q->followers.back();
+            q->sub.connId = follower.connId;
+            q->sub.subId = follower.subId;
+            q->followers.pop_back();
+            return;
+        }
+
+        for (auto it = q->followers.begin(); it != q->followers.end(); ++it) {
+            if (it->connId == connId && it->subId == subId) {
+                q->followers.erase(it);
+                return;
+            }
+        }
+    }
+
+    // Weighted fair scheduling with aging: when a query is queued, it is given a deadline of the current time plus
+    // its cost, which is its own scan time plus the recent usage of its connection and IP. The query with the
+    // earliest deadline runs next. New and cheap queries go first, and a client running many expensive queries (on
+    // one or many connections) mostly slows down its own queries. Since deadlines don't move while a query waits,
+    // and the cost is capped at MaxDelaySlices time slices, every query gets to run again within a bounded time,
+    // however many cheaper queries keep arriving.
+    static constexpr uint64_t MaxDelaySlices = 10;
+
+    void enqueue(DBQuery *q) {
+        uint64_t now = hoytech::curr_time_us();
+        double cost = q->usedTime();
+
+        if (auto it = connUsage.find(q->sub.connId); it != connUsage.end()) {
+            cost += it->second.usage.get(now);
+            if (auto ip = ipUsage.find(it->second.ipAddr); ip != ipUsage.end()) cost += ip->second.usage.get(now);
+        }
+
+        double maxCost = double(MaxDelaySlices * cfg().relay__queryTimesliceBudgetMicroseconds);
+        running.push(Queued{ double(now) + std::min(cost, maxCost), q });
+    }
+
+    // Cancelled queries are only removed from the queue when they reach its front
+    DBQuery *takeNext() {
+        while (running.size()) {
+            DBQuery *q = running.top().q;
+            running.pop();
+
+            if (!q->dead) return q;
+            delete q;
+        }
+
+        return nullptr;
+    }
+
+    // After a time slice: completes or aborts the query, or else puts it back in the queue (or lends it out)
+    void settle(lmdb::txn &txn, DBQuery *q, bool complete, bool mayLend) {
+        chargeUsage(q->sub.connId, q->usedTime() - q->chargedTime);
+        q->chargedTime = q->usedTime();
+
+        if (complete && !q->hitMaxEvents) {
+            if (cacheBytes && q->recordResults) {
+                cache.put(q->filterKey, QueryResultCache::Entry{ q->sub.latestEventId, std::move(q->filterResults) }, cacheBytes);
+            }
+
+            finish(q);
+
+            uint64_t total = q->numSent;
+
+            if (onComplete) {
+                onComplete(txn, q->sub, total);
+                for (auto &follower : q->followers) onComplete(txn, follower, total);
+            }
 
             delete q;
+        } else if (complete || overBudget(q)) {
+            finish(q);
+
+            std::string_view reason = q->hitMaxEvents ? "query matched too many events" : "query took too long";
+
+            if (onAbort) {
+                onAbort(txn, q->sub, reason);
+                for (auto &follower : q->followers) onAbort(txn, follower, reason);
+            }
+
+            delete q;
+        } else if (mayLend && onLend && running.size() && q->followers.empty()) {
+            // While lent, no followers may join, since the borrower would be reading the follower list
+            forgetFilter(q);
+            if (onLend(q)) return;
+
+            if (coalesce) byFilter.try_emplace(q->filterKey, q);
+            enqueue(q);
         } else {
-            running.push_back(q);
+            enqueue(q);
+        }
+    }
+
+    void chargeUsage(uint64_t connId, uint64_t time) {
+        auto it = connUsage.find(connId);
+        if (it == connUsage.end()) return;
+
+        uint64_t now = hoytech::curr_time_us();
+        it->second.usage.add(now, time);
+        if (auto ip = ipUsage.find(it->second.ipAddr); ip != ipUsage.end()) ip->second.usage.add(now, time);
+    }
+
+    // Unregisters all of a query's subscribers, prior to onComplete/onAbort
+    void finish(DBQuery *q) {
+        forgetFilter(q);
+
+        auto unregister = [&](const Subscription &sub){
+            auto &connQueries = conns[sub.connId];
+            connQueries.erase(sub.subId);
+            if (connQueries.empty()) conns.erase(sub.connId);
+        };
+
+        unregister(q->sub);
+        for (const auto &follower : q->followers) unregister(follower);
+    }
+
+    void forgetFilter(DBQuery *q) {
+        auto it = byFilter.find(q->filterKey);
+        if (it != byFilter.end() && it->second == q) byFilter.erase(it);
+    }
+
+    // Topping up an entry walks every event stored since it was computed, so past this it's cheaper to re-scan
+    static constexpr uint64_t MaxCacheTopUp = 10'000;
+
+    // If the query's filter group is cached, it will be answered from there instead of by scanning
+    void startFromCache(DBQuery *q) {
+        auto &metrics = PrometheusMetrics::getInstance();
+
+        auto *entry = cache.find(q->filterKey);
+        uint64_t latest = q->sub.latestEventId;
+
+        if (!entry || entry->latestEventId > latest || latest - entry->latestEventId > MaxCacheTopUp) {
+            if (entry) cache.erase(q->filterKey);
+            metrics.queryCacheMissesTotal.inc();
+            return;
         }
+
+        q->topUp = std::make_unique<DBQuery::CacheTopUp>(DBQuery::CacheTopUp{
+            entry->filterResults,
+            std::vector<std::vector<DBQuery::FoundEvent>>(entry->filterResults.size()),
+            entry->latestEventId + 1,
+        });
+    }
+
+    // One time slice of answering a query from the cache: matches the events stored since the cached
+    // result against the filters, pausing when the slice is used up. Then merges them into the cached
+    // result, re-applies the limits, and sends it. If a cached event has since been deleted, the event
+    // that should take its place is unknown, so the query falls back to an ordinary scan.
+    bool runTopUp(lmdb::txn &txn, DBQuery *q) {
+        auto &metrics = PrometheusMetrics::getInstance();
+        auto &t = *q->topUp;
+        const auto &filters = q->sub.filterGroup.filters;
+        uint64_t latest = q->sub.latestEventId;
+
+        uint64_t startTime = hoytech::curr_time_us();
+        uint64_t budget = cfg().relay__queryTimesliceBudgetMicroseconds;
+        uint64_t numVisited = 0;
+        bool paused = false;
+
+        if (t.nextLevId <= latest) {
+            env.foreach_Event(txn, [&](auto &ev){
+                if (ev.primaryKeyId > latest) return false;
+
+                if (++numVisited % 256 == 0 && hoytech::curr_time_us() - startTime > budget) {
+                    paused = true;
+                    return false;
+                }
+
+                PackedEventView packed(ev.buf);
+                for (size_t i = 0; i < filters.size(); i++) {
+                    if (filters[i].doesMatch(packed)) t.newer[i].push_back({ ev.primaryKeyId, packed.created_at() });
+                }
+
+                t.nextLevId = ev.primaryKeyId + 1;
+                return true;
+            }, false, t.nextLevId);
+        }
+
+        q->totalTime += hoytech::curr_time_us() - startTime;
+        if (paused) return false;
+
+        auto cmp = [](const DBQuery::FoundEvent &a, const DBQuery::FoundEvent &b){
+            return a.created == b.created ? a.levId > b.levId : a.created > b.created;
+        };
+
+        std::vector<std::vector<DBQuery::FoundEvent>> merged(filters.size());
+
+        for (size_t i = 0; i < filters.size(); i++) {
+            std::sort(t.newer[i].begin(), t.newer[i].end(), cmp);
+            std::merge(t.newer[i].begin(), t.newer[i].end(), t.cached[i].begin(), t.cached[i].end(), std::back_inserter(merged[i]), cmp);
+            if (merged[i].size() > filters[i].limit) merged[i].resize(filters[i].limit);
+        }
+
+        q->topUp.reset();
+
+        auto eventPayloadCursor = lmdb::cursor::open(txn, env.dbi_EventPayload);
+
+        for (const auto &r : merged) {
+            for (const auto &ev : r) {
+                std::string_view key = lmdb::to_sv<uint64_t>(ev.levId), val;
+                if (!eventPayloadCursor.get(key, val, MDB_SET_KEY)) {
+                    metrics.queryCacheInvalidationsTotal.inc();
+                    metrics.queryCacheMissesTotal.inc();
+                    return false; // the stale entry is replaced once the scan completes
+                }
+            }
+        }
+
+        metrics.queryCacheHitsTotal.inc();
+
+        LevIdSet sent;
+        std::vector<uint64_t> toSend;
+
+        for (const auto &r : merged) {
+            for (const auto &ev : r) {
+                if (sent.insert(ev.levId)) toSend.push_back(ev.levId);
+            }
+        }
+
+        if (!q->dead) {
+            if (usePrefetchFor(q->sub)) scanPool->prefetch(txn, toSend);
+
+            for (auto levId : toSend) {
+                emitEvent(txn, eventPayloadCursor, q->sub, levId);
+                for (const auto &follower : q->followers) emitEvent(txn, eventPayloadCursor, follower, levId);
+            }
+
+            flushBatch(txn, q->sub);
+            for (const auto &follower : q->followers) flushBatch(txn, follower);
+        }
+
+        if (q->recordSent) q->sentEventsOrdered = std::move(toSend);
+        q->numSent = sent.size();
+        q->filterResults = std::move(merged);
+        q->filterGroupIndex = filters.size();
+
+        return true;
     }
 };
@@ -0,0 +1,160 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "golpe.h"
+
+#include "ThreadPool.h"
+
+
+// Pool of threads shared by the ReqWorkers, used by DBScan to read the cursors of wide filters (for
+// example follow lists with thousands of authors) in parallel, instead of one after another. Also
+// used by QueryScheduler to page in events before sending them, see prefetch().
+//
+// Helpers are only ever given work while idle, and the caller works through the items too, so a
+// caller never waits for helpers that are busy with another ReqWorker's task: if none are free, it
+// simply does all the work itself, and it only waits for items that a helper has already started.
+//
+// Each helper thread opens its own read txn, which may be at a slightly newer snapshot than the
+// caller's. This is harmless for the same reason that resuming a paused scan in a later txn is:
+// events newer than the subscription's latestEventId are skipped, and events deleted in the meantime
+// are dropped when sent.
+
+struct ScanPool : NonCopyable {
+    void init(uint64_t numThreads, uint64_t minCursors_) {
+        minCursors = minCursors_;
+        if (numThreads == 0) return;
+
+        idle = std::vector<std::atomic<bool>>(numThreads);
+
+        pool.init("ScanPool", numThreads, [this](auto &thr){
+            runHelper(thr);
+        });
+    }
+
+    // If it's worth reading this many cursors in parallel
+    bool useFor(uint64_t numCursors) const {
+        return enabled() && numCursors >= minCursors;
+    }
+
+    bool enabled() const {
+        return !pool.empty();
+    }
+
+    // Reads the Event records of levIds and starts read-ahead of their payloads, so that when the DB is
+    // larger than RAM, their page faults are taken concurrently here rather than one at a time by the
+    // caller. Payloads may span several pages, so the rest are requested with MADV_WILLNEED.
+    void prefetch(lmdb::txn &txn, const std::vector<uint64_t> &levIds) {
+        if (!enabled() || levIds.size() < 2) return;
+
+        static const uintptr_t pageSize = ::sysconf(_SC_PAGESIZE);
+
+        parallelFor(txn, levIds.size(), [&](lmdb::txn &t, uint64_t i){
+            env.lookup_Event(t, levIds[i]);
+
+            std::string_view payload;
+            if (!env.dbi_EventPayload.get(t, lmdb::to_sv<uint64_t>(levIds[i]), payload)) return;
+            if (payload.size() <= pageSize) return;
+
+            uintptr_t start = uintptr_t(payload.data()) & ~(pageSize - 1);
+            uintptr_t end = uintptr_t(payload.data()) + payload.size();
+            ::madvise((void*)start, end - start, MADV_WILLNEED);
+        });
+    }
+
+    // Calls job(txn, i) for every i < n, spread over the idle helpers and the calling thread (which uses
+    // txn). Returns once all calls have finished. If any throw, the first error is re-thrown here.
+    void parallelFor(lmdb::txn &txn, uint64_t n, const std::function<void(lmdb::txn &, uint64_t)> &job) {
+        if (n == 0) return;
+
+        auto task = std::make_shared<Task>(n, job);
+        uint64_t numHelpers = 0;
+        uint64_t start = nextHelper++;
+
+        for (uint64_t i = 0; i < pool.size() && numHelpers < n - 1; i++) {
+            uint64_t h = (start + i) % pool.size();
+            if (!idle[h].load() || !idle[h].exchange(false)) continue;
+
+            pool.dispatch(h, MsgScanPool{task});
+            numHelpers++;
+        }
+
+        task->work(txn);
+        task->finish();
+
+        if (task->error.size()) throw herr("parallel scan failed: ", task->error);
+    }
+
+  private:
+    struct Task : NonCopyable {
+        uint64_t n;
+        const std::function<void(lmdb::txn &, uint64_t)> &job; // only valid until the caller's finish() returns
+        std::atomic<uint64_t> next = 0;
+
+        std::mutex mutex;
+        std::condition_variable cv;
+        uint64_t active = 0; // helpers currently working on items
+        bool finished = false;
+        std::string error;
+
+        Task(uint64_t n, const std::function<void(lmdb::txn &, uint64_t)> &job) : n(n), job(job) {}
+
+        void work(lmdb::txn &txn) {
+            try {
+                for (uint64_t i = next++; i < n; i = next++) job(txn, i);
+            } catch (std::exception &e) {
+                next = n;
+                std::unique_lock<std::mutex> lk(mutex);
+                if (error.empty()) error = e.what();
+            }
+        }
+
+        // Called by a helper. Does nothing if the caller has already run out of items, since it may
+        // have returned, making job invalid
+        void help(lmdb::txn &txn) {
+            {
+                std::unique_lock<std::mutex> lk(mutex);
+                if (finished) return;
+                active++;
+            }
+
+            work(txn);
+
+            std::unique_lock<std::mutex> lk(mutex);
+            if (--active == 0) cv.notify_all();
+        }
+
+        // Called by the caller once it has run out of items: waits for the items helpers are still on
+        void finish() {
+            std::unique_lock<std::mutex> lk(mutex);
+            finished = true;
+            cv.wait(lk, [&]{ return active == 0; });
+        }
+    };
+
+    struct MsgScanPool {
+        std::shared_ptr<Task> task;
+    };
+
+    ThreadPool<MsgScanPool> pool;
+    std::vector<std::atomic<bool>> idle; // helper -> waiting for work. Cleared by a caller claiming it
+    std::atomic<uint64_t> nextHelper = 0;
+    uint64_t minCursors = MAX_U64;
+
+    void runHelper(ThreadPool<MsgScanPool>::Thread &thr) {
+        while (1) {
+            idle[thr.id] = true;
+            auto newMsgs = thr.inbox.pop_all();
+
+            auto txn = env.txn_ro();
+            for (auto &newMsg : newMsgs) newMsg.task->help(txn);
+            txn.abort();
+        }
+    }
+};
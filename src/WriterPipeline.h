@@ -49,8 +49,31 @@ struct WriterPipeline {
     std::condition_variable backpressureCv;
     std::mutex backpressureMutex;
 
+    // Checked before verification, see EventIdFilter.h. Only events identical to the stored one count,
+    // since an event can reuse a stored id with a different (invalid) sig.
+    bool isKnownDuplicate(const tao::json::value &eventJson) {
+        if (!eventIdFilter.isLoaded() || !eventJson.is_object()) return false;
+
+        std::string packedStr, sig;
+
+        try {
+            packedStr = nostrJsonToPackedEvent(eventJson);
+            if (!eventIdFilter.mayContain(PackedEventView(packedStr).id())) return false;
+            if (nostrHash(eventJson) != Bytes32(PackedEventView(packedStr).id())) return false;
+            sig = from_hex(jsonGetString(eventJson.at("sig"), "event sig was not a string"), false);
+        } catch (...) {
+            return false;
+        }
+
+        auto txn = env.txn_ro();
+        auto existing = lookupEventById(txn, PackedEventView(packedStr).id());
+        return existing && storedEventMatches(txn, *existing, packedStr, sig);
+    }
+
   public:
     WriterPipeline() {
+        eventIdFilter.loadInBackground();
+
         validatorThread = std::thread([&]() {
             setThreadName("Validator");
 
@@ -67,6 +90,12 @@ struct WriterPipeline {
                         return;
                     }
 
+                    if (isKnownDuplicate(m.eventJson)) {
+                        numLive--;
+                        totalDups++;
+                        continue;
+                    }
+
                     std::string packedStr;
                     std::string jsonStr;
 
@@ -0,0 +1,446 @@
+#include <iostream>
+#include <chrono>
+#include <random>
+
+#include <docopt.h>
+#include "golpe.h"
+
+#include "filters.h"
+#include "PackedEvent.h"
+#include "EventCounts.h"
+#include "EventParser.h"
+
+
+static const char USAGE[] =
+R"(
+    Usage:
+      bench match [--events=<events>] [--repeat=<repeat>] <filter>
+      bench hll [--events=<events>] [--repeat=<repeat>]
+      bench parse [--events=<events>] [--repeat=<repeat>]
+
+    Options:
+      --events=<events>  Number of most recent events to load [default: 100000]
+      --repeat=<repeat>  Number of passes over the events [default: 10]
+)";
+
+
+// Benchmarks run against the most recent events in the DB, loaded into memory first.
+//
+// match: Matches the filter group with both NostrFilter::doesMatch() and the straightforward matcher
+// below (a binary search per item, and one pass over the event's tags per tag filter), and compares
+// their results and timings.
+//
+//   ./strfry bench match '{"kinds":[7],"#p":["..."]}'
+//
+// hll: Times the NIP-45 HLL operations of EventCounts: computing and setting the register for each
+// e/p tag, encoding each tag value's registers as stored, and merging those back together.
+//
+//   ./strfry bench hll
+//
+// parse: Parses the events' JSON, and variants of it (reformatted, re-escaped, with extra or missing
+// fields, wrong types, changed content, etc), with both EventParser and the tao::json DOM path of
+// parseAndVerifyEvent(), checking that they accept and reject the same inputs and build identical
+// packed events and JSON. Signatures aren't checked, since test DBs are usually imported unsigned.
+//
+//   ./strfry bench parse
+
+namespace {
+
+struct ReferenceFilter {
+    using Set = std::vector<std::string>;
+
+    std::optional<Set> ids;
+    std::optional<Set> authors;
+    std::optional<std::vector<uint64_t>> kinds;
+    std::vector<std::pair<char, Set>> tags;
+    uint64_t since;
+    uint64_t until;
+
+    ReferenceFilter(const NostrFilter &f) : since(f.since), until(f.until) {
+        auto copySet = [](const FilterSetBytes &s){
+            Set out;
+            for (size_t i = 0; i < s.size(); i++) out.push_back(s.at(i));
+            return out;
+        };
+
+        if (f.ids) ids = copySet(*f.ids);
+        if (f.authors) authors = copySet(*f.authors);
+        if (f.kinds) kinds = f.kinds->items;
+        for (const auto &[tagName, s] : f.tags) tags.emplace_back(tagName, copySet(s));
+    }
+
+    static bool contains(const Set &s, std::string_view v) {
+        return std::binary_search(s.begin(), s.end(), v, [](std::string_view a, std::string_view b){ return a < b; });
+    }
+
+    bool doesMatch(PackedEventView ev) const {
+        if (ev.created_at() < since || ev.created_at() > until) return false;
+
+        if (ids && !contains(*ids, ev.id())) return false;
+        if (authors && !contains(*authors, ev.pubkey())) return false;
+        if (kinds && !std::binary_search(kinds->begin(), kinds->end(), ev.kind())) return false;
+
+        for (const auto &[tag, s] : tags) {
+            bool foundMatch = false;
+
+            std::function<bool(char, std::string_view)> cb = [&](char tagName, std::string_view tagVal){
+                if (tagName == tag && contains(s, tagVal)) {
+                    foundMatch = true;
+                    return false;
+                }
+                return true;
+            };
+
+            ev.foreachTag(cb);
+
+            if (!foundMatch) return false;
+        }
+
+        return true;
+    }
+};
+
+}
+
+
+template <typename F>
+static double timeNs(F f) {
+    auto t0 = std::chrono::steady_clock::now();
+    f();
+    auto t1 = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count();
+}
+
+static void benchHll(const std::vector<std::string> &events, uint64_t repeat) {
+    using HllRegisters = EventCounts::HllRegisters;
+
+    struct Update {
+        std::string_view tagVal;
+        std::string_view pubkey;
+    };
+
+    std::vector<Update> updates;
+
+    for (const auto &e : events) {
+        PackedEventView packed(e);
+        packed.foreachTag([&](char tagName, std::string_view tagVal){
+            if ((tagName == 'e' || tagName == 'p') && tagVal.size() == 32) updates.push_back({ tagVal, packed.pubkey() });
+            return true;
+        });
+    }
+
+    if (updates.empty()) throw herr("no e or p tags in events");
+
+    flat_hash_map<std::string_view, HllRegisters> sketches;
+    uint64_t numSet = 0;
+
+    double updateNs = timeNs([&]{
+        for (uint64_t i = 0; i < repeat; i++) {
+            for (const auto &u : updates) {
+                auto [index, value] = EventCounts::hllRegister(u.tagVal, u.pubkey);
+                if (sketches[u.tagVal].set(index, value)) numSet++;
+            }
+        }
+    });
+
+    std::vector<std::string> encoded;
+    uint64_t numDense = 0;
+
+    double encodeNs = timeNs([&]{
+        for (const auto &[_, regs] : sketches) {
+            encoded.push_back(regs.encode());
+            if (encoded.back().size() == sizeof(regs.r)) numDense++;
+        }
+    });
+
+    HllRegisters merged;
+
+    double mergeNs = timeNs([&]{
+        for (uint64_t i = 0; i < repeat; i++) {
+            for (const auto &enc : encoded) merged.merge(enc);
+        }
+    });
+
+    std::cout << "updates: " << updates.size() << ", tag values: " << sketches.size() << " (" << numDense << " dense), registers raised: " << numSet << "\n";
+    std::cout << "update: " << (updateNs / (updates.size() * repeat)) << " ns/tag\n";
+    std::cout << "encode: " << (encodeNs / encoded.size()) << " ns/sketch\n";
+    std::cout << "merge: " << (mergeNs / (encoded.size() * repeat)) << " ns/sketch\n";
+}
+
+
+// Serialises v as JSON, with object keys in reverse order, random whitespace, and randomly \u-escaped ASCII
+
+static void fuzzSerialise(const tao::json::value &v, std::mt19937 &rng, std::string &out) {
+    auto ws = [&]{
+        if (rng() % 4 == 0) out += " \n\t\r"[rng() % 4];
+    };
+
+    auto str = [&](std::string_view s){
+        static const char *hex = "0123456789abcdef";
+        out += '"';
+        for (unsigned char c : s) {
+            if (c == '"' || c == '\\' || c < 0x20 || (c < 0x80 && rng() % 8 == 0)) {
+                out += "\\u00";
+                out += hex[c >> 4];
+                out += hex[c & 15];
+            } else {
+                out += c;
+            }
+        }
+        out += '"';
+    };
+
+    ws();
+
+    if (v.is_object()) {
+        const auto &obj = v.get_object();
+        out += '{';
+        bool first = true;
+        for (auto it = obj.rbegin(); it != obj.rend(); ++it) {
+            if (!first) out += ',';
+            first = false;
+            ws();
+            str(it->first);
+            ws();
+            out += ':';
+            fuzzSerialise(it->second, rng, out);
+        }
+        ws();
+        out += '}';
+    } else if (v.is_array()) {
+        out += '[';
+        bool first = true;
+        for (const auto &e : v.get_array()) {
+            if (!first) out += ',';
+            first = false;
+            fuzzSerialise(e, rng, out);
+        }
+        ws();
+        out += ']';
+    } else if (v.is_string()) {
+        str(v.get_string());
+    } else {
+        out += tao::json::to_string(v);
+    }
+
+    ws();
+}
+
+// Variants of an event's JSON. Most are valid JSON, and some of those are not valid events
+static std::vector<std::string> fuzzVariants(std::string_view json, std::mt19937 &rng) {
+    std::vector<std::string> out;
+    out.emplace_back(json);
+
+    auto v = tao::json::from_string(json);
+    out.emplace_back(tao::json::to_string(v, 2));
+
+    auto mutate = [&](auto f){
+        auto m = v;
+        f(m);
+        std::string s;
+        fuzzSerialise(m, rng, s);
+        out.emplace_back(std::move(s));
+    };
+
+    mutate([](auto &){});
+    mutate([](auto &m){ m["extra"] = tao::json::value::array({ 1, -2.5, nullptr, tao::json::value({ { "z", "y" }, { "a", true } }) }); });
+    mutate([](auto &m){ m["tags"].get_array().push_back(tao::json::value::array({ "x", "y", tao::json::value({ { "b", 1 }, { "a", tao::json::value::array({ 2 }) } }) })); });
+    mutate([](auto &m){ m["tags"].get_array().push_back(tao::json::value::array({ "x", "y", 3, false })); });
+    mutate([](auto &m){ m["content"] = m["content"].get_string() + "é\n\"\\"; });
+
+    static const char *fields[] = { "id", "pubkey", "created_at", "kind", "tags", "content", "sig" };
+    const char *field = fields[rng() % 7];
+
+    mutate([&](auto &m){ m.get_object().erase(field); });
+    mutate([&](auto &m){ m[field] = m[field].is_string() ? tao::json::value(12345) : tao::json::value("12345"); });
+    mutate([](auto &m){ m["tags"].get_array().push_back(tao::json::value::array({ "x", 1 })); });
+    mutate([](auto &m){ m["tags"].get_array().push_back("x"); });
+    mutate([](auto &m){ m["tags"].get_array().push_back(tao::json::value(tao::json::empty_array)); });
+    mutate([](auto &m){ m["kind"] = -1; });
+    mutate([](auto &m){ m["created_at"] = 1.5; });
+
+    out.push_back(out[1].substr(0, rng() % out[1].size()));
+
+    return out;
+}
+
+static void benchParse(const std::vector<std::string> &events, uint64_t repeat) {
+    EventParser parser;
+    std::mt19937 rng(0);
+
+    struct Result {
+        bool ok = false;
+        bool idOk = false;
+        std::string packedStr;
+        std::string jsonStr;
+    };
+
+    auto viaDom = [&](std::string_view json, bool wrapped){
+        Result r;
+
+        try {
+            auto v = tao::json::from_string(json);
+            if (wrapped) v = v.at(1);
+            parseAndVerifyEvent(v, nullptr, false, false, r.packedStr, r.jsonStr);
+            r.ok = true;
+            r.idOk = nostrHash(v) == Bytes32(PackedEventView(r.packedStr).id());
+        } catch (std::exception &) {}
+
+        return r;
+    };
+
+    auto viaParser = [&](std::string_view json, bool wrapped){
+        Result r;
+
+        try {
+            if (wrapped) parser.parseMessage(json);
+            else parser.parseEvent(json);
+            parser.build(false, false, r.packedStr, r.jsonStr);
+            r.ok = true;
+        } catch (std::exception &) {
+            return r;
+        }
+
+        try {
+            std::string packedStr, jsonStr;
+            parser.build(true, false, packedStr, jsonStr);
+            r.idOk = true;
+        } catch (std::exception &) {}
+
+        return r;
+    };
+
+    // Check that the results are identical before reporting any timings
+
+    uint64_t numVariants = 0, numValid = 0;
+
+    for (const auto &e : events) {
+        for (const auto &json : fuzzVariants(e, rng)) {
+            for (bool wrapped : { false, true }) {
+                std::string input = wrapped ? std::string("[\"EVENT\",") + json + "]" : json;
+                auto a = viaDom(input, wrapped);
+                auto b = viaParser(input, wrapped);
+
+                if (a.ok != b.ok || a.idOk != b.idOk || a.packedStr != b.packedStr || a.jsonStr != b.jsonStr) {
+                    throw herr("mismatch (tao::json: ", a.ok ? (a.idOk ? "valid" : "bad id") : "rejected",
+                               ", EventParser: ", b.ok ? (b.idOk ? "valid" : "bad id") : "rejected", ") on input: ", input);
+                }
+
+                numVariants++;
+                if (a.ok) numValid++;
+            }
+        }
+    }
+
+    std::cout << "events: " << events.size() << ", variants: " << numVariants << " (" << numValid << " valid)\n";
+
+    auto run = [&](const char *name, auto f){
+        double ns = timeNs([&]{
+            for (uint64_t i = 0; i < repeat; i++) {
+                for (const auto &e : events) f(e);
+            }
+        });
+
+        std::cout << name << ": " << (ns / (events.size() * repeat)) << " ns/event\n";
+    };
+
+    std::string packedStr, jsonStr;
+
+    run("tao::json", [&](const std::string &e){
+        auto v = tao::json::from_string(e);
+        parseAndVerifyEvent(v, nullptr, false, false, packedStr, jsonStr);
+        nostrHash(v);
+    });
+
+    run("EventParser", [&](const std::string &e){
+        parser.parseEvent(e);
+        parser.build(true, false, packedStr, jsonStr);
+    });
+}
+
+
+void cmd_bench(const std::vector<std::string> &subArgs) {
+    std::map<std::string, docopt::value> args = docopt::docopt(USAGE, subArgs, true, "");
+
+    uint64_t numEvents = args["--events"].asLong();
+    uint64_t repeat = args["--repeat"].asLong();
+    if (repeat == 0) throw herr("repeat must be non-zero");
+
+    bool parse = args["parse"].asBool();
+    std::vector<std::string> events; // packed, or JSON for parse
+
+    {
+        auto txn = env.txn_ro();
+        Decompressor decomp;
+
+        env.foreach_Event(txn, [&](auto &ev){
+            if (parse) events.emplace_back(getEventJson(txn, decomp, ev.primaryKeyId));
+            else events.emplace_back(ev.buf);
+            return events.size() < numEvents;
+        }, true);
+    }
+
+    if (events.empty()) throw herr("no events in DB");
+
+    if (parse) {
+        benchParse(events, repeat);
+        return;
+    }
+
+    if (args["hll"].asBool()) {
+        benchHll(events, repeat);
+        return;
+    }
+
+    std::string filterStr = args["<filter>"].asString();
+
+    NostrFilterGroup filterGroup(tao::json::from_string(filterStr), MAX_U64);
+
+    std::vector<ReferenceFilter> reference;
+    for (const auto &f : filterGroup.filters) reference.emplace_back(f);
+
+    auto run = [&](const char *name, auto matches){
+        uint64_t numMatched = 0;
+
+        double ns = timeNs([&]{
+            for (uint64_t i = 0; i < repeat; i++) {
+                for (const auto &e : events) {
+                    if (matches(PackedEventView(e))) numMatched++;
+                }
+            }
+        });
+
+        std::cout << name << ": " << (ns / (events.size() * repeat)) << " ns/event, " << (numMatched / repeat) << " matched\n";
+
+        return numMatched;
+    };
+
+    // Check that the results are identical before reporting any timings
+
+    for (const auto &e : events) {
+        PackedEventView packed(e);
+
+        bool expected = false;
+        for (const auto &r : reference) {
+            if (r.doesMatch(packed)) {
+                expected = true;
+                break;
+            }
+        }
+
+        if (filterGroup.doesMatch(packed) != expected) throw herr("mismatch on event ", to_hex(packed.id()));
+    }
+
+    std::cout << "events: " << events.size() << ", filters: " << filterGroup.filters.size() << "\n";
+
+    run("reference", [&](PackedEventView packed){
+        for (const auto &r : reference) {
+            if (r.doesMatch(packed)) return true;
+        }
+        return false;
+    });
+
+    run("doesMatch", [&](PackedEventView packed){
+        return filterGroup.doesMatch(packed);
+    });
+}
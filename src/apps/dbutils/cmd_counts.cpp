@@ -0,0 +1,72 @@
+#include <iostream>
+
+#include <docopt.h>
+#include "golpe.h"
+
+#include "EventCounts.h"
+
+
+static const char USAGE[] =
+R"(
+    Usage:
+      counts info
+      counts build [--tags=<tags>] [--batch-size=<batchSize>]
+      counts drop
+
+    Options:
+      --tags=<tags>             Tag names to count per tag value and kind [default: eptaq]
+      --batch-size=<batchSize>  Number of events to count per write transaction [default: 100000]
+)";
+
+
+void cmd_counts(const std::vector<std::string> &subArgs) {
+    std::map<std::string, docopt::value> args = docopt::docopt(USAGE, subArgs, true, "");
+
+    if (args["info"].asBool()) {
+        auto txn = env.txn_ro();
+
+        auto m = EventCounts::maintained(txn);
+
+        if (!m) {
+            std::cout << "not built\n";
+        } else {
+            if (m->upTo != MAX_U64) std::cout << "build in progress, at levId " << m->upTo << " (run build again if it was interrupted)\n";
+            std::cout << "counted tags: " << m->tagNames << "\n";
+            std::cout << "entries: " << (env.dbi_EventCount.stat(txn).ms_entries - 1) << "\n";
+        }
+    } else if (args["build"].asBool()) {
+        std::string tagNames = args["--tags"].asString();
+
+        for (char c : tagNames) {
+            if (!isalpha(c)) throw herr("tag names must be single letters");
+        }
+
+        uint64_t batchSize = args["--batch-size"].asLong();
+        if (batchSize == 0) throw herr("batch size must be non-zero");
+
+        {
+            auto txn = env.txn_rw();
+            EventCounts::beginBuild(txn, tagNames);
+            txn.commit();
+        }
+
+        uint64_t numEvents = 0;
+
+        while (1) {
+            auto txn = env.txn_rw();
+            bool done = EventCounts::buildBatch(txn, batchSize, numEvents);
+            txn.commit();
+
+            if (done) break;
+            LI << "Counted " << numEvents << " events";
+        }
+
+        LI << "Counted " << numEvents << " events";
+    } else if (args["drop"].asBool()) {
+        auto txn = env.txn_rw();
+
+        EventCounts::drop(txn);
+
+        txn.commit();
+    }
+}
@@ -0,0 +1,120 @@
+#include <iostream>
+
+#include <docopt.h>
+#include "golpe.h"
+
+#include "PubkeyIds.h"
+
+
+static const char USAGE[] =
+R"(
+    Usage:
+      migrate [--batch-size=<batchSize>] [--reindex]
+
+    Options:
+      --batch-size=<batchSize>  Number of events to process per write transaction [default: 100000]
+      --reindex                 Rebuild all the indices listed below, even if the DB is already at the current version
+)";
+
+
+// Upgrades a version 3 or 4 DB in place, by rebuilding the indices that have changed since:
+//   4: added the Event__tagKind index
+//   5: pubkeys in the pubkey, pubkeyKind, and p-tag index entries replaced by interned ids (see PubkeyIds.h)
+//   6: id index only stores the first EVENT_ID_INDEX_PREFIX_SIZE bytes of ids
+//
+// The indices are emptied first, and the version is only updated once all events are re-indexed, so an
+// interrupted migration can simply be run again.
+//
+// The tagKind index is only rebuilt if events.indexTagKind is on. On a current DB, this is also how the
+// index is built after turning that option back on, in which case the other indices are left alone.
+// --reindex rebuilds all of them on a current DB, the same way as an upgrade does.
+
+void cmd_migrate(const std::vector<std::string> &subArgs) {
+    std::map<std::string, docopt::value> args = docopt::docopt(USAGE, subArgs, true, "");
+
+    uint64_t batchSize = args["--batch-size"].asLong();
+    if (batchSize == 0) throw herr("batch size must be non-zero");
+
+    bool buildTagKind = cfg().events__indexTagKind;
+    bool reindex = args["--reindex"].asBool();
+    bool onlyTagKind = false;
+
+    {
+        auto txn = env.txn_ro();
+        auto m = env.lookup_Meta(txn, 1);
+        if (!m) throw herr("no Meta entry?");
+
+        if (m->dbVersion() == CURR_DB_VERSION && !reindex) {
+            if (!buildTagKind || m->noTagKindIndex() == 0) {
+                LI << "DB is already at version " << CURR_DB_VERSION;
+                return;
+            }
+
+            onlyTagKind = true;
+        }
+
+        if (m->dbVersion() < 3) throw herr("can only migrate from DB version 3 or later, this DB is version ", m->dbVersion());
+    }
+
+    {
+        auto txn = env.txn_rw();
+
+        if (onlyTagKind) {
+            lmdb::dbi_drop(txn, env.dbi_Event__tagKind);
+        } else {
+            for (auto dbi : { env.dbi_Event__id, env.dbi_Event__pubkey, env.dbi_Event__pubkeyKind, env.dbi_Event__tag, env.dbi_Event__tagKind }) {
+                lmdb::dbi_drop(txn, dbi);
+            }
+        }
+
+        txn.commit();
+    }
+
+    uint64_t startLevId = 0;
+    uint64_t numEvents = 0;
+
+    while (1) {
+        auto txn = env.txn_rw();
+        PubkeyIds::Scope pubkeyIdsScope(txn);
+        uint64_t processed = 0;
+
+        env.foreach_Event(txn, [&](auto &ev){
+            PackedEventView packed(ev.buf);
+            auto levId = lmdb::to_sv<uint64_t>(ev.primaryKeyId);
+            uint64_t indexTime = packed.created_at();
+
+            if (!onlyTagKind) {
+                env.dbi_Event__id.put(txn, makeKey_StringUint64(packed.id().substr(0, EVENT_ID_INDEX_PREFIX_SIZE), indexTime), levId);
+
+                std::string pubkeyId = PubkeyIds::indexKey(packed.pubkey());
+                env.dbi_Event__pubkey.put(txn, makeKey_StringUint64(pubkeyId, indexTime), levId);
+                env.dbi_Event__pubkeyKind.put(txn, makeKey_StringUint64Uint64(pubkeyId, packed.kind(), indexTime), levId);
+            }
+
+            packed.foreachTag([&](char tagName, std::string_view tagVal){
+                std::string tagKey = PubkeyIds::indexTagKey(tagName, tagVal);
+                if (!onlyTagKind) env.dbi_Event__tag.put(txn, makeKey_StringUint64(tagKey, indexTime), levId);
+                if (buildTagKind) env.dbi_Event__tagKind.put(txn, makeKey_StringUint64Uint64(tagKey, packed.kind(), indexTime), levId);
+                return true;
+            });
+
+            startLevId = ev.primaryKeyId + 1;
+            return ++processed < batchSize;
+        }, false, startLevId);
+
+        numEvents += processed;
+
+        if (processed < batchSize) {
+            auto m = env.lookup_Meta(txn, 1);
+            env.update_Meta(txn, *m, { .dbVersion = CURR_DB_VERSION, .noTagKindIndex = uint64_t(buildTagKind ? 0 : 1) });
+            txn.commit();
+            break;
+        }
+
+        txn.commit();
+        LI << "Indexed " << numEvents << " events";
+    }
+
+    if (onlyTagKind) LI << "Built the tag+kind index for " << numEvents << " events";
+    else LI << "Migrated " << numEvents << " events to DB version " << CURR_DB_VERSION;
+}
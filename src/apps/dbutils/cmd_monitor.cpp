@@ -57,7 +57,7 @@ void cmd_monitor(const std::vector<std::string> &subArgs) {
     exitOnSigPipe();
 
     env.foreach_Event(txn, [&](auto &ev){
-        monitors.process(txn, ev, [&](RecipientList &&recipients, uint64_t levId){
+        monitors.process(ev.primaryKeyId, PackedEventView(ev.buf), [&](RecipientList &&recipients, uint64_t levId){
             for (auto &r : recipients) {
                 if (r.connId == interestConnId && r.subId.str() == interestSubId) {
                     std::cout << getEventJson(txn, decomp, levId) << "\n";
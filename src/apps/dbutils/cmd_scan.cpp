@@ -10,7 +10,11 @@
 static const char USAGE[] =
 R"(
     Usage:
-      scan [--pause=<pause>] [--metrics] [--count] <filter>
+      scan [--pause=<pause>] [--metrics] [--count] [--index-stats] [--plan=<plan>] <filter>
+
+    Options:
+      --index-stats  Choose plans by estimated cost, as the relay does, instead of by fixed precedence
+      --plan=<plan>  Use this type of plan (ie PubkeyTag) where possible. Implies --index-stats
 )";
 
 
@@ -25,6 +29,8 @@ void cmd_scan(const std::vector<std::string> &subArgs) {
 
     std::string filterStr = args["<filter>"].asString();
 
+    if (args["--plan"]) DBScan::forcedPlan = args["--plan"].asString();
+
 
     DBQuery query(tao::json::from_string(filterStr));
 
@@ -32,6 +38,8 @@ void cmd_scan(const std::vector<std::string> &subArgs) {
 
     auto txn = env.txn_ro();
 
+    if (args["--index-stats"].asBool() || DBScan::forcedPlan.size()) indexStats.load(txn, 100'000);
+
     uint64_t numEvents = 0;
 
     exitOnSigPipe();
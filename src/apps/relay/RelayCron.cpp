@@ -52,9 +52,17 @@ void RelayServer::runCron() {
             auto txn = env.txn_rw();
             NegentropyFilterCache neFilterCache;
 
-            uint64_t numDeleted = deleteEvents(txn, neFilterCache, expiredLevIds);
+            uint64_t numDeleted;
 
-            txn.commit();
+            try {
+                numDeleted = deleteEvents(txn, neFilterCache, expiredLevIds);
+                txn.commit();
+            } catch (...) {
+                indexStats.discard();
+                throw;
+            }
+
+            indexStats.commit();
 
             if (numDeleted) LI << "Deleted " << numDeleted << " events (ephemeral=" << numEphemeral << " expired=" << numExpired << ")";
         }
@@ -5,18 +5,39 @@
 
 void RelayServer::runIngester(ThreadPool<MsgIngester>::Thread &thr) {
     RelayServerCtx rsctx;
+    uint64_t nextVerifier = thr.id;
 
     while(1) {
         auto newMsgs = thr.inbox.pop_all();
 
         auto txn = env.txn_ro();
 
-        std::vector<MsgWriter> writerMsgs;
+        std::vector<MsgVerifier> verifierMsgs;
 
         for (auto &newMsg : newMsgs) {
             if (auto msg = std::get_if<MsgIngester::ClientMessage>(&newMsg.msg)) {
+                auto processEvent = [&]{
+                    // EVENTs bypass the JSON DOM: rsctx.eventParser has already parsed msg->payload
+
+                    PROM_INC_CLIENT_MSG("EVENT");
+                    if (cfg().relay__logging__dumpInEvents) LI << "[" << msg->connId << "] dumpInEvent: " << msg->payload; 
+
+                    try {
+                        ingesterProcessEvent(txn, rsctx, msg->connId, msg->ipAddr, verifierMsgs);
+                    } catch (std::exception &e) {
+                        sendOKResponse(msg->connId, rsctx.eventParser.idHex(), false, std::string("invalid: ") + e.what());
+                        if (cfg().relay__logging__invalidEvents) LI << "Rejected invalid event: " << e.what();
+                    }
+                };
+
                 try {
-                    if (msg->payload.starts_with('[')) {
+                    if (EventParser::isEventMessage(msg->payload)) {
+                        rsctx.eventParser.parseMessage(msg->payload);
+
+                        if (cfg().relay__logging__dumpInAll) LI << "[" << msg->connId << "] dumpInAll: " << msg->payload; 
+
+                        processEvent();
+                    } else if (msg->payload.starts_with('[')) {
                         auto payload = tao::json::from_string(msg->payload);
 
                         if (cfg().relay__logging__dumpInAll) LI << "[" << msg->connId << "] dumpInAll: " << msg->payload; 
@@ -27,16 +48,9 @@ void RelayServer::runIngester(ThreadPool<MsgIngester>::Thread &thr) {
                         auto &cmd = jsonGetString(arr[0], "first element not a command like REQ");
 
                         if (cmd == "EVENT") {
-                            PROM_INC_CLIENT_MSG(cmd);
-                            if (cfg().relay__logging__dumpInEvents) LI << "[" << msg->connId << "] dumpInEvent: " << msg->payload; 
-
-                            try {
-                                ingesterProcessEvent(txn, rsctx, msg->connId, msg->ipAddr, arr[1], writerMsgs);
-                            } catch (std::exception &e) {
-                                sendOKResponse(msg->connId, arr[1].is_object() && arr[1].at("id").is_string() ? arr[1].at("id").get_string() : "?",
-                                               false, std::string("invalid: ") + e.what());
-                                if (cfg().relay__logging__invalidEvents) LI << "Rejected invalid event: " << e.what();
-                            }
+                            // Unusually encoded EVENT message that isEventMessage() didn't recognise
+                            rsctx.eventParser.parseMessage(msg->payload);
+                            processEvent();
                         } else if (cmd == "AUTH") {
                             PROM_INC_CLIENT_MSG(cmd);
                             if (cfg().relay__logging__dumpInAll) LI << "[" << msg->connId << "] dumpInAuth: " << msg->payload;
@@ -55,7 +69,7 @@ void RelayServer::runIngester(ThreadPool<MsgIngester>::Thread &thr) {
                             std::string subIdStr;
 
                             try {
-                                ingesterProcessReq(txn, rsctx, msg->connId, arr, cmd == "COUNT", subIdStr);
+                                ingesterProcessReq(txn, rsctx, msg->connId, msg->ipAddr, arr, cmd == "COUNT", subIdStr);
                             } catch (std::exception &e) {
                                 if (subIdStr.size()) sendClosedError(msg->connId, subIdStr, std::string("bad req: ") + e.what());
                                 else sendNoticeError(msg->connId, std::string("bad req: ") + e.what());
@@ -96,22 +110,35 @@ void RelayServer::runIngester(ThreadPool<MsgIngester>::Thread &thr) {
                 PrometheusMetrics::getInstance().authenticatedConnections.dec();
                 rsctx.connIdToAuthSession.erase(connId);
 
-                tpWriter.dispatch(connId, MsgWriter{MsgWriter::CloseConn{connId}});
+                uint64_t numEvents = 0;
+                if (auto it = rsctx.connIdToNextEventSeq.find(connId); it != rsctx.connIdToNextEventSeq.end()) {
+                    numEvents = it->second;
+                    rsctx.connIdToNextEventSeq.erase(it);
+                }
+
+                tpWriter.dispatch(connId, MsgWriter{MsgWriter::CloseConn{connId, numEvents}});
                 tpReqWorker.dispatch(connId, MsgReqWorker{MsgReqWorker::CloseConn{connId}});
                 tpNegentropy.dispatch(connId, MsgNegentropy{MsgNegentropy::CloseConn{connId}});
             }
         }
 
-        if (writerMsgs.size()) {
-            tpWriter.dispatchMulti(0, writerMsgs);
+        // Signatures are checked by the verifier pool. Events are spread over all verifier threads,
+        // so that a burst from one connection doesn't queue up behind a single thread. Each carries a
+        // per-connection sequence number, which the writer uses to restore their order.
+
+        for (auto &m : verifierMsgs) {
+            tpVerifier.dispatch(nextVerifier++, std::move(m));
         }
     }
 }
 
-void RelayServer::ingesterProcessEvent(lmdb::txn &txn, RelayServerCtx &rsctx, uint64_t connId, std::string ipAddr, const tao::json::value &origJson, std::vector<MsgWriter> &output) {
+void RelayServer::ingesterProcessEvent(lmdb::txn &txn, RelayServerCtx &rsctx, uint64_t connId, std::string ipAddr, std::vector<MsgVerifier> &output) {
     std::string packedStr, jsonStr;
 
-    parseAndVerifyEvent(origJson, rsctx.secpCtx, true, true, packedStr, jsonStr);
+    // Checks everything except the signature, which is done later by runVerifier()
+    rsctx.eventParser.build(true, true, packedStr, jsonStr);
+    std::string sig = from_hex(rsctx.eventParser.sigHex(), false);
+    if (sig.size() != 64) throw herr("unexpected sig size");
 
     PackedEventView packed(packedStr);
     Bytes32 authedPubkey;
@@ -119,7 +146,7 @@ void RelayServer::ingesterProcessEvent(lmdb::txn &txn, RelayServerCtx &rsctx, ui
     {
         // discard reposts that embed protected events
         if (packed.kind() == 6 || packed.kind() == 16) {
-            if (origJson.at("content").get_string().find("[\"-\"]") != std::string::npos) {
+            if (rsctx.eventParser.content().find("[\"-\"]") != std::string::npos) {
                 auto idHex = to_hex(packed.id());
                 LI << "Repost embedded a protected event, blocking: " << idHex;
                 sendOKResponse(connId, idHex, false, "blocked: reposts can't embed protected events");
@@ -189,19 +216,27 @@ void RelayServer::ingesterProcessEvent(lmdb::txn &txn, RelayServerCtx &rsctx, ui
     }
 
     {
-        auto existing = lookupEventById(txn, packed.id());
-        if (existing) {
-            auto hexId = to_hex(packed.id());
-            LI << "[" << connId << "] Duplicate event, skipping: " << hexId;
-            sendOKResponse(connId, hexId, true, "duplicate: have this event");
-            return;
+        // Many events are re-broadcasts of ones we already have, so check for these before verifying the
+        // signature. The id was checked by build(), but the sig wasn't: an event reusing a stored id is
+        // only skipped if its sig is the stored one. Otherwise it is verified, and the writer reports it
+        // as a duplicate, as it does for any stored event that a filter miss lets through (see EventIdFilter.h).
+
+        if (!eventIdFilter.isLoaded() || eventIdFilter.mayContain(packed.id())) {
+            auto existing = lookupEventById(txn, packed.id());
+            if (existing && storedEventMatches(txn, *existing, packedStr, sig)) {
+                auto hexId = to_hex(packed.id());
+                LI << "[" << connId << "] Duplicate event, skipping: " << hexId;
+                sendOKResponse(connId, hexId, true, "duplicate: have this event");
+                return;
+            }
         }
     }
 
-    output.emplace_back(MsgWriter{MsgWriter::AddEvent{connId, std::move(ipAddr), std::move(packedStr), std::move(jsonStr), authedPubkey}});
+    uint64_t seq = rsctx.connIdToNextEventSeq[connId]++;
+    output.emplace_back(MsgVerifier{MsgVerifier::VerifyEvent{connId, seq, std::move(ipAddr), std::move(packedStr), std::move(jsonStr), std::move(sig), authedPubkey}});
 }
 
-void RelayServer::ingesterProcessReq(lmdb::txn &txn, RelayServerCtx &rsctx, uint64_t connId, const tao::json::value &arr, bool countOnly, std::string &outSubIdStr) {
+void RelayServer::ingesterProcessReq(lmdb::txn &txn, RelayServerCtx &rsctx, uint64_t connId, const std::string &ipAddr, const tao::json::value &arr, bool countOnly, std::string &outSubIdStr) {
     if (arr.get_array().size() < 2 + 1) throw herr("arr too small");
     outSubIdStr = jsonGetString(arr[1], "subscription id was not a string");
     if (arr.get_array().size() > 2 + cfg().relay__maxReqFilterSize) throw herr("arr too big");
@@ -258,7 +293,7 @@ void RelayServer::ingesterProcessReq(lmdb::txn &txn, RelayServerCtx &rsctx, uint
 
     Subscription sub(connId, outSubIdStr, std::move(filterGroup), countOnly);
 
-    tpReqWorker.dispatch(connId, MsgReqWorker{MsgReqWorker::NewSub{std::move(sub)}});
+    tpReqWorker.dispatch(connId, MsgReqWorker{MsgReqWorker::NewSub{std::move(sub), ipAddr}});
 }
 
 void RelayServer::ingesterProcessClose(lmdb::txn &txn, uint64_t connId, const tao::json::value &arr) {
@@ -6,13 +6,20 @@
 
 
 void RelayServer::runReqMonitor(ThreadPool<MsgReqMonitor>::Thread &thr) {
-    auto dbChangeWatcher = hoytech::file_change_monitor(dbDir + "/data.mdb");
+    // Events written by this relay are announced directly by the Writer. This watcher is a fallback that
+    // picks up events written by other processes using the same DB (import, router, sync, etc)
 
-    dbChangeWatcher.setDebounce(100);
+    std::unique_ptr<hoytech::file_change_monitor> dbChangeWatcher;
 
-    dbChangeWatcher.run([&](){
-        tpReqMonitor.dispatchToAll([]{ return MsgReqMonitor{MsgReqMonitor::DBChange{}}; });
-    });
+    if (thr.id == 0) {
+        dbChangeWatcher = std::make_unique<hoytech::file_change_monitor>(dbDir + "/data.mdb");
+
+        dbChangeWatcher->setDebounce(100);
+
+        dbChangeWatcher->run([&](){
+            tpReqMonitor.dispatchToAll([]{ return MsgReqMonitor{MsgReqMonitor::DBChange{}}; });
+        });
+    }
 
 
     Decompressor decomp;
@@ -58,9 +65,13 @@ void RelayServer::runReqMonitor(ThreadPool<MsgReqMonitor>::Thread &thr) {
                 connIdToAuthedPubkey.erase(msg->connId);
                 monitors.closeConn(msg->connId);
             } else if (std::get_if<MsgReqMonitor::DBChange>(&newMsg.msg)) {
-                env.foreach_Event(txn, [&](auto &ev){
-                    monitors.process(txn, ev, [&](RecipientList &&recipients, uint64_t levId){
-                        PackedEventView packed(ev.buf);
+                newEventFeed.foreachNew(txn, thr.id, currEventId, latestEventId, [&](NewEventFeed::Event &ev){
+                    PackedEventView packed(ev.packed);
+
+                    monitors.process(ev.levId, packed, [&](RecipientList &&recipients, uint64_t){
+                        auto json = ev.json(txn, decomp);
+                        if (json.empty()) return; // deleted since it was written
+
                         if (ReadRestrictor::restrictedKinds().contains(packed.kind())) {
                             RecipientList filteredRecipients;
                             for (const auto &recipient : recipients) {
@@ -71,14 +82,13 @@ void RelayServer::runReqMonitor(ThreadPool<MsgReqMonitor>::Thread &thr) {
                                 }
                             }
                             if (!filteredRecipients.empty()) {
-                                sendEventToBatch(std::move(filteredRecipients), std::string(getEventJson(txn, decomp, levId)));
+                                sendEventToBatch(std::move(filteredRecipients), json);
                             }
                         } else {
-                            sendEventToBatch(std::move(recipients), std::string(getEventJson(txn, decomp, levId)));
+                            sendEventToBatch(std::move(recipients), json);
                         }
                     });
-                    return true;
-                }, false, currEventId + 1);
+                });
 
                 currEventId = latestEventId;
             }
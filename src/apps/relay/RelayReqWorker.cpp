@@ -1,19 +1,29 @@
 #include "RelayServer.h"
 #include "QueryScheduler.h"
 #include "ReadRestrictor.h"
+#include "EventCounts.h"
 
 
 void RelayServer::runReqWorker(ThreadPool<MsgReqWorker>::Thread &thr) {
     Decompressor decomp;
     QueryScheduler queries;
+    queries.coalesce = true;
+    queries.scanPool = &scanPool;
     flat_hash_map<uint64_t, Bytes32> connIdToAuthedPubkey;
+    std::deque<MsgReqWorker::RunQuery> borrowed; // queries lent to us by other threads
+
+    auto authedFor = [&](uint64_t connId){
+        auto it = connIdToAuthedPubkey.find(connId);
+        if (it != connIdToAuthedPubkey.end()) return it->second;
+        for (const auto &b : borrowed) if (b.query->sub.connId == connId) return b.authed;
+        return Bytes32();
+    };
 
     queries.onEvent = [&](lmdb::txn &txn, const auto &sub, uint64_t levId, std::string_view eventPayload){
         if (sub.countOnly) return;
-        auto it = connIdToAuthedPubkey.find(sub.connId);
         auto ev = lookupEventByLevId(txn, levId);
         PackedEventView packed(ev.buf);
-        Bytes32 subscriberAuthedPubkey = it == connIdToAuthedPubkey.end() ? Bytes32() : it->second;
+        Bytes32 subscriberAuthedPubkey = authedFor(sub.connId);
         if (!ReadRestrictor::shouldSendToSubscriber(packed, subscriberAuthedPubkey)) {
             return; 
         }
@@ -21,22 +31,31 @@ void RelayServer::runReqWorker(ThreadPool<MsgReqWorker>::Thread &thr) {
         sendEvent(sub.connId, sub.subId, decodeEventPayload(txn, decomp, eventPayload, nullptr, nullptr));
     };
 
-    queries.onComplete = [&](lmdb::txn &, Subscription &sub, uint64_t total){
-        if (sub.countOnly) {
-            bool limited = false;
+    auto sendCount = [&](const Subscription &sub, uint64_t total, bool limited, const std::optional<std::string> &hll = std::nullopt){
+        tao::json::value countBody = tao::json::value({
+            { "count", total },
+        });
 
-            if (total > cfg().relay__maxFilterLimitCount) {
-                total = cfg().relay__maxFilterLimitCount;
-                limited = true;
-            }
+        if (limited) countBody["limited"] = true;
+        if (hll) countBody["hll"] = *hll;
+
+        sendToConn(sub.connId, tao::json::to_string(tao::json::value::array({ "COUNT", sub.subId.str(), countBody })));
+    };
+
+    auto sendCappedCount = [&](const Subscription &sub, uint64_t total, const std::optional<std::string> &hll = std::nullopt){
+        bool limited = false;
 
-            tao::json::value countBody = tao::json::value({
-                { "count", total },
-            });
+        if (total > cfg().relay__maxFilterLimitCount) {
+            total = cfg().relay__maxFilterLimitCount;
+            limited = true;
+        }
 
-            if (limited) countBody["limited"] = true;
+        sendCount(sub, total, limited, hll);
+    };
 
-            sendToConn(sub.connId, tao::json::to_string(tao::json::value::array({ "COUNT", sub.subId.str(), countBody })));
+    queries.onComplete = [&](lmdb::txn &, Subscription &sub, uint64_t total){
+        if (sub.countOnly) {
+            sendCappedCount(sub, total);
         } else {
             PROM_INC_RELAY_MSG("EOSE");
             sendToConn(sub.connId, tao::json::to_string(tao::json::value::array({ "EOSE", sub.subId.str() })));
@@ -44,16 +63,62 @@ void RelayServer::runReqWorker(ThreadPool<MsgReqWorker>::Thread &thr) {
         }
     };
 
+    queries.onAbort = [&](lmdb::txn &, Subscription &sub, std::string_view reason){
+        PrometheusMetrics::getInstance().abortedQueriesTotal.inc();
+        sendClosedError(sub.connId, sub.subId.str(), std::string(reason));
+    };
+
+    // Work sharing: when a query is paused while others are queued behind it, it is lent to an idle ReqWorker
+    // thread. The borrower runs it until it completes or the borrower has its own work, and then gives it back,
+    // so completion (EOSE, hand-off to ReqMonitor) and cancellation are still handled in order by the owner.
+
+    uint64_t numReqWorkers = reqWorkerIdle.size();
+
+    queries.onLend = [&](DBQuery *q){
+        for (uint64_t i = 1; i < numReqWorkers; i++) {
+            uint64_t target = (thr.id + i) % numReqWorkers;
+            if (!reqWorkerIdle[target].load() || !reqWorkerIdle[target].exchange(false)) continue;
+
+            tpReqWorker.dispatch(target, MsgReqWorker{MsgReqWorker::RunQuery{q, thr.id, authedFor(q->sub.connId)}});
+            return true;
+        }
+
+        return false;
+    };
+
+    auto giveBack = [&](MsgReqWorker::RunQuery &b, bool complete){
+        tpReqWorker.dispatch(b.ownerThread, MsgReqWorker{MsgReqWorker::ReturnQuery{b.query, complete}});
+    };
+
     while(1) {
-        auto newMsgs = queries.running.empty() ? thr.inbox.pop_all() : thr.inbox.pop_all_no_wait();
+        bool busy = !queries.running.empty() || !borrowed.empty();
+        if (!busy) reqWorkerIdle[thr.id] = true;
+
+        auto newMsgs = busy ? thr.inbox.pop_all_no_wait() : thr.inbox.pop_all();
+        reqWorkerIdle[thr.id] = false;
 
         auto txn = env.txn_ro();
 
+        queries.cacheBytes = cfg().relay__queryCacheBytes;
+        queries.prefetchWindow = cfg().relay__prefetchWindow;
+        queries.maxQueryTimeMicroseconds = cfg().relay__maxQueryTimeMilliseconds * 1000;
+        queries.maxQueryEvents = cfg().relay__maxQueryEvents;
+
         for (auto &newMsg : newMsgs) {
             if (auto msg = std::get_if<MsgReqWorker::NewSub>(&newMsg.msg)) {
                 auto connId = msg->sub.connId;
 
-                if (!queries.addSub(txn, std::move(msg->sub))) {
+                if (msg->sub.countOnly) {
+                    // Limited and capped in the same way as a scanned count, so the answer doesn't depend on which is used
+                    if (auto total = EventCounts::count(txn, msg->sub.filterGroup)) {
+                        PrometheusMetrics::getInstance().materialisedCountsTotal.inc();
+                        queries.removeSub(connId, msg->sub.subId);
+                        sendCappedCount(msg->sub, *total, EventCounts::hll(txn, msg->sub.filterGroup));
+                        continue;
+                    }
+                }
+
+                if (!queries.addSub(txn, std::move(msg->sub), msg->ipAddr)) {
                     sendNoticeError(connId, std::string("too many concurrent REQs"));
                 }
 
@@ -67,10 +132,28 @@ void RelayServer::runReqWorker(ThreadPool<MsgReqWorker>::Thread &thr) {
                 connIdToAuthedPubkey.erase(msg->connId);
                 queries.closeConn(msg->connId);
                 tpReqMonitor.dispatch(msg->connId, MsgReqMonitor{MsgReqMonitor::CloseConn{msg->connId}});
+            } else if (auto msg = std::get_if<MsgReqWorker::RunQuery>(&newMsg.msg)) {
+                borrowed.push_back(std::move(*msg));
+            } else if (auto msg = std::get_if<MsgReqWorker::ReturnQuery>(&newMsg.msg)) {
+                queries.adopt(txn, msg->query, msg->complete);
             }
         }
 
-        queries.process(txn);
+        if (!queries.running.empty()) {
+            // Our own queries come first, so give back anything borrowed
+            for (auto &b : borrowed) giveBack(b, false);
+            borrowed.clear();
+
+            queries.process(txn);
+        } else if (!borrowed.empty()) {
+            auto b = std::move(borrowed.front());
+            borrowed.pop_front();
+
+            bool complete = b.query->dead ? false : queries.runSlice(txn, b.query);
+
+            if (complete || b.query->dead || queries.overBudget(b.query)) giveBack(b, complete);
+            else borrowed.push_back(std::move(b));
+        }
 
         txn.abort();
     }
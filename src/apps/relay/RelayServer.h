@@ -15,7 +15,10 @@
 
 #include "Subscription.h"
 #include "ThreadPool.h"
+#include "ScanPool.h"
+#include "NewEventFeed.h"
 #include "events.h"
+#include "EventParser.h"
 #include "filters.h"
 #include "jsonParseUtils.h"
 #include "Decompressor.h"
@@ -25,6 +28,36 @@
 
 
 
+// An event's JSON, framed as the tail of an EVENT message: "<headRoom>",<evJson>]
+// The head room is where the ["EVENT","<subId> prefix gets written, right-aligned. Frames are
+// shared by all recipients of an event (across all websocket threads), so the JSON is copied out
+// of the DB once, and not per recipient or per websocket thread.
+
+struct EventFrame : NonCopyable {
+    static constexpr size_t HeadRoom = 10 + MAX_SUBID_SIZE;
+
+    std::string buf;
+
+    EventFrame(std::string_view evJson) {
+        buf.reserve(HeadRoom + evJson.size() + 3);
+        buf.resize(HeadRoom);
+        buf += "\",";
+        buf += evJson;
+        buf += "]";
+    }
+
+    // Writes the prefix for subId into the head room of b (which must be a copy of buf, or buf itself)
+    static std::string_view render(std::string &b, std::string_view subId) {
+        auto *p = b.data() + MAX_SUBID_SIZE - subId.size();
+        memcpy(p, "[\"EVENT\",\"", 10);
+        memcpy(p + 10, subId.data(), subId.size());
+        return std::string_view(p, b.data() + b.size());
+    }
+};
+
+using SharedEventFrame = std::shared_ptr<EventFrame>;
+
+
 struct MsgWebsocket : NonCopyable {
     struct Send {
         uint64_t connId;
@@ -38,7 +71,8 @@ struct MsgWebsocket : NonCopyable {
 
     struct SendEventToBatch {
         RecipientList list;
-        std::string evJson;
+        SharedEventFrame frame;
+        bool exclusive; // no other websocket thread was sent this frame, so it can be written to
     };
 
     struct GracefulShutdown {
@@ -65,27 +99,69 @@ struct MsgIngester : NonCopyable {
     MsgIngester(Var &&msg_) : msg(std::move(msg_)) {}
 };
 
+struct MsgVerifier : NonCopyable {
+    struct VerifyEvent {
+        uint64_t connId;
+        uint64_t seq; // per connection, see runWriter()
+        std::string ipAddr;
+        std::string packedStr;
+        std::string jsonStr;
+        std::string sig;
+        Bytes32 authed;
+    };
+
+    using Var = std::variant<VerifyEvent>;
+    Var msg;
+    MsgVerifier(Var &&msg_) : msg(std::move(msg_)) {}
+};
+
 struct MsgWriter : NonCopyable {
     struct AddEvent {
         uint64_t connId;
+        uint64_t seq;
         std::string ipAddr;
         std::string packedStr;
         std::string jsonStr;
         Bytes32 authed;
     };
 
+    // Failed signature verification: only sent so that the OK is released in order
+    struct Rejected {
+        uint64_t connId;
+        uint64_t seq;
+        std::string eventIdHex;
+        std::string message;
+    };
+
     struct CloseConn {
         uint64_t connId;
+        uint64_t numEvents; // number of events sent to the verifiers for this connection
     };
 
-    using Var = std::variant<AddEvent, CloseConn>;
+    using Var = std::variant<AddEvent, Rejected, CloseConn>;
     Var msg;
     MsgWriter(Var &&msg_) : msg(std::move(msg_)) {}
 };
 
+struct DBQuery;
+
 struct MsgReqWorker : NonCopyable {
     struct NewSub {
         Subscription sub;
+        std::string ipAddr;
+    };
+
+    // A paused query lent by another (busy) ReqWorker, to be run until complete or until this thread gets busy
+    struct RunQuery {
+        DBQuery *query;
+        uint64_t ownerThread;
+        Bytes32 authed;
+    };
+
+    // A lent query being given back to its owner
+    struct ReturnQuery {
+        DBQuery *query;
+        bool complete;
     };
 
     struct SetAuth {
@@ -102,7 +178,7 @@ struct MsgReqWorker : NonCopyable {
         uint64_t connId;
     };
 
-    using Var = std::variant<NewSub, SetAuth, RemoveSub, CloseConn>;
+    using Var = std::variant<NewSub, SetAuth, RemoveSub, CloseConn, RunQuery, ReturnQuery>;
     Var msg;
     MsgReqWorker(Var &&msg_) : msg(std::move(msg_)) {}
 };
@@ -169,21 +245,32 @@ struct MsgNegentropy : NonCopyable {
 struct RelayServerCtx {
     secp256k1_context *secpCtx = secp256k1_context_create(SECP256K1_CONTEXT_VERIFY);
     FilterValidator filterValidator;
+    EventParser eventParser;
     SessionToken::Generator challengeGenerator;
     flat_hash_map<uint64_t, AuthSession> connIdToAuthSession;
+    flat_hash_map<uint64_t, uint64_t> connIdToNextEventSeq;
 };
 
 struct RelayServer {
-    uS::Async *hubTrigger = nullptr;
+    // One per websocket thread. A connection is owned by websocket thread connOwner(connId)
+    std::vector<uS::Async*> hubTriggers;
+    std::atomic<uint64_t> numConnections = 0;
+    std::atomic<uint64_t> nextConnectionSeq = 1; // shared by the websocket threads, see newConnId()
+
+    // One per ReqWorker thread. Set while the thread is waiting for work, and cleared by a thread lending it a query
+    std::vector<std::atomic<bool>> reqWorkerIdle;
 
     // Thread Pools
 
     ThreadPool<MsgWebsocket> tpWebsocket;
     ThreadPool<MsgIngester> tpIngester;
+    ThreadPool<MsgVerifier> tpVerifier;
     ThreadPool<MsgWriter> tpWriter;
     ThreadPool<MsgReqWorker> tpReqWorker;
     ThreadPool<MsgReqMonitor> tpReqMonitor;
     ThreadPool<MsgNegentropy> tpNegentropy;
+    ScanPool scanPool; // shared by the ReqWorkers, see DBScan
+    NewEventFeed newEventFeed; // shared by the ReqMonitors
     std::thread cronThread;
     std::thread signalHandlerThread;
 
@@ -193,12 +280,14 @@ struct RelayServer {
 
     void runIngester(ThreadPool<MsgIngester>::Thread &thr);
     void ingesterProcessEvent(lmdb::txn &txn, uint64_t connId, flat_hash_map<uint64_t, AuthSession*> &connIdToAuthStatus, std::string ipAddr, secp256k1_context *secpCtx, const tao::json::value &origJson, std::vector<MsgWriter> &output);
-    void ingesterProcessEvent(lmdb::txn &txn, RelayServerCtx &rsctx, uint64_t connId, std::string ipAddr, const tao::json::value &origJson, std::vector<MsgWriter> &output);
-    void ingesterProcessReq(lmdb::txn &txn, RelayServerCtx &rsctx, uint64_t connId, const tao::json::value &arr, bool countOnly, std::string &outSubIdStr);
+    void ingesterProcessEvent(lmdb::txn &txn, RelayServerCtx &rsctx, uint64_t connId, std::string ipAddr, std::vector<MsgVerifier> &output);
+    void ingesterProcessReq(lmdb::txn &txn, RelayServerCtx &rsctx, uint64_t connId, const std::string &ipAddr, const tao::json::value &arr, bool countOnly, std::string &outSubIdStr);
     void ingesterProcessClose(lmdb::txn &txn, uint64_t connId, const tao::json::value &arr);
     void ingesterProcessAuth(RelayServerCtx &rsctx, uint64_t connId, const tao::json::value &eventJson);
     void ingesterProcessNegentropy(lmdb::txn &txn, RelayServerCtx &rsctx, uint64_t connId, const tao::json::value &origJson);
 
+    void runVerifier(ThreadPool<MsgVerifier>::Thread &thr);
+
     void runWriter(ThreadPool<MsgWriter>::Thread &thr);
 
     void runReqWorker(ThreadPool<MsgReqWorker>::Thread &thr);
@@ -213,14 +302,34 @@ struct RelayServer {
 
     // Utils (can be called by any thread)
 
+    // A connId is a sequence number shared by all websocket threads, with the owning thread in the top
+    // bits. The other pools dispatch on connId % size, so the low bits must not depend on the owner,
+    // otherwise all of one websocket thread's connections could land on the same worker.
+    static constexpr uint64_t ConnOwnerShift = 48;
+
+    uint64_t newConnId(uint64_t websocketThread) {
+        return (websocketThread << ConnOwnerShift) | nextConnectionSeq++;
+    }
+
+    static uint64_t connOwner(uint64_t connId) {
+        return connId >> ConnOwnerShift;
+    }
+
+    void dispatchToWebsocketThread(uint64_t websocketThread, MsgWebsocket &&m) {
+        tpWebsocket.dispatch(websocketThread, std::move(m));
+        hubTriggers[websocketThread]->send();
+    }
+
+    void dispatchToWebsocket(uint64_t connId, MsgWebsocket &&m) {
+        dispatchToWebsocketThread(connOwner(connId), std::move(m));
+    }
+
     void sendToConn(uint64_t connId, std::string &&payload) {
-        tpWebsocket.dispatch(0, MsgWebsocket{MsgWebsocket::Send{connId, std::move(payload)}});
-        hubTrigger->send();
+        dispatchToWebsocket(connId, MsgWebsocket{MsgWebsocket::Send{connId, std::move(payload)}});
     }
 
     void sendToConnBinary(uint64_t connId, std::string &&payload) {
-        tpWebsocket.dispatch(0, MsgWebsocket{MsgWebsocket::SendBinary{connId, std::move(payload)}});
-        hubTrigger->send();
+        dispatchToWebsocket(connId, MsgWebsocket{MsgWebsocket::SendBinary{connId, std::move(payload)}});
     }
 
     void sendEvent(uint64_t connId, const SubId &subId, std::string_view evJson) {
@@ -239,39 +348,56 @@ struct RelayServer {
         sendToConn(connId, std::move(reply));
     }
 
-    void sendEventToBatch(RecipientList &&list, std::string &&evJson) {
-        tpWebsocket.dispatch(0, MsgWebsocket{MsgWebsocket::SendEventToBatch{std::move(list), std::move(evJson)}});
-        hubTrigger->send();
+    void sendEventToBatch(RecipientList &&list, std::string_view evJson) {
+        auto frame = std::make_shared<EventFrame>(evJson);
+        uint64_t numThreads = hubTriggers.size();
+
+        if (numThreads == 1) {
+            dispatchToWebsocketThread(0, MsgWebsocket{MsgWebsocket::SendEventToBatch{std::move(list), std::move(frame), true}});
+            return;
+        }
+
+        // Split recipients by owning websocket thread
+
+        std::vector<RecipientList> lists(numThreads);
+        uint64_t numLists = 0;
+
+        for (auto &item : list) {
+            auto &l = lists[connOwner(item.connId)];
+            if (l.empty()) numLists++;
+            l.push_back(item);
+        }
+
+        for (uint64_t i = 0; i < numThreads; i++) {
+            if (lists[i].empty()) continue;
+            dispatchToWebsocketThread(i, MsgWebsocket{MsgWebsocket::SendEventToBatch{std::move(lists[i]), frame, numLists == 1}});
+        }
     }
 
     void sendNoticeError(uint64_t connId, std::string &&payload) {
         PROM_INC_RELAY_MSG("NOTICE");
         LI << "sending error to [" << connId << "]: " << payload;
         auto reply = tao::json::value::array({ "NOTICE", std::string("ERROR: ") + payload });
-        tpWebsocket.dispatch(0, MsgWebsocket{MsgWebsocket::Send{connId, std::move(tao::json::to_string(reply))}});
-        hubTrigger->send();
+        dispatchToWebsocket(connId, MsgWebsocket{MsgWebsocket::Send{connId, std::move(tao::json::to_string(reply))}});
     }
 
     void sendClosedError(uint64_t connId, const std::string &subId, std::string &&payload) {
         PROM_INC_RELAY_MSG("CLOSED");
         LI << "sending closed to [" << connId << "]: " << payload;
         auto reply = tao::json::value::array({ "CLOSED", subId, std::string("ERROR: ") + payload });
-        tpWebsocket.dispatch(0, MsgWebsocket{MsgWebsocket::Send{connId, std::move(tao::json::to_string(reply))}});
-        hubTrigger->send();
+        dispatchToWebsocket(connId, MsgWebsocket{MsgWebsocket::Send{connId, std::move(tao::json::to_string(reply))}});
     }
 
     void sendOKResponse(uint64_t connId, std::string_view eventIdHex, bool written, std::string_view message) {
         PROM_INC_RELAY_MSG("OK");
         auto reply = tao::json::value::array({ "OK", eventIdHex, written, message });
-        tpWebsocket.dispatch(0, MsgWebsocket{MsgWebsocket::Send{connId, std::move(tao::json::to_string(reply))}});
-        hubTrigger->send();
+        dispatchToWebsocket(connId, MsgWebsocket{MsgWebsocket::Send{connId, std::move(tao::json::to_string(reply))}});
     }
 
     void sendAuthChallenge(uint64_t connId, std::string_view challenge) {
         PROM_INC_RELAY_MSG("AUTH");
         PrometheusMetrics::getInstance().authChallengesSentTotal.inc();
         auto reply = tao::json::value::array({ "AUTH", challenge });
-        tpWebsocket.dispatch(0, MsgWebsocket{MsgWebsocket::Send{connId, std::move(tao::json::to_string(reply))}});
-        hubTrigger->send();
+        dispatchToWebsocket(connId, MsgWebsocket{MsgWebsocket::Send{connId, std::move(tao::json::to_string(reply))}});
     }
 };
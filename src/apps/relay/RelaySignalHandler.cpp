@@ -16,8 +16,10 @@ void RelayServer::runSignalHandler() {
         if (s != 0) throw herr("unable to sigwait: ", strerror(errno));
 
         if (sig == SIGUSR1) {
-            tpWebsocket.dispatch(0, MsgWebsocket{MsgWebsocket::GracefulShutdown{}});
-            if (hubTrigger) hubTrigger->send();
+            for (uint64_t i = 0; i < tpWebsocket.size(); i++) {
+                tpWebsocket.dispatch(i, MsgWebsocket{MsgWebsocket::GracefulShutdown{}});
+                if (hubTriggers[i]) hubTriggers[i]->send();
+            }
         } else {
             LW << "Got unexpected signal: " << sig;
         }
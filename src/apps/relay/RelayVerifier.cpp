@@ -0,0 +1,36 @@
+#include "RelayServer.h"
+
+
+void RelayServer::runVerifier(ThreadPool<MsgVerifier>::Thread &thr) {
+    secp256k1_context *secpCtx = secp256k1_context_create(SECP256K1_CONTEXT_VERIFY);
+
+    while(1) {
+        auto newMsgs = thr.inbox.pop_all();
+
+        // libsecp256k1 has no batch schnorr verification, so verify one at a time, but
+        // forward the whole batch to the writer with a single dispatch. Rejections go to the writer
+        // too, so that each connection's OKs are sent in order (see runWriter())
+
+        std::vector<MsgWriter> writerMsgs;
+
+        for (auto &newMsg : newMsgs) {
+            if (auto msg = std::get_if<MsgVerifier::VerifyEvent>(&newMsg.msg)) {
+                PackedEventView packed(msg->packedStr);
+
+                try {
+                    if (!verifySig(secpCtx, msg->sig, packed.id(), packed.pubkey())) throw herr("bad signature");
+                } catch (std::exception &e) {
+                    if (cfg().relay__logging__invalidEvents) LI << "Rejected invalid event: " << e.what();
+                    writerMsgs.emplace_back(MsgWriter{MsgWriter::Rejected{msg->connId, msg->seq, to_hex(packed.id()), std::string("invalid: ") + e.what()}});
+                    continue;
+                }
+
+                writerMsgs.emplace_back(MsgWriter{MsgWriter::AddEvent{msg->connId, msg->seq, std::move(msg->ipAddr), std::move(msg->packedStr), std::move(msg->jsonStr), msg->authed}});
+            }
+        }
+
+        if (writerMsgs.size()) {
+            tpWriter.dispatchMulti(0, writerMsgs);
+        }
+    }
+}
@@ -49,7 +49,6 @@ void RelayServer::runWebsocket(ThreadPool<MsgWebsocket>::Thread &thr) {
     uWS::Hub hub;
     uWS::Group<uWS::SERVER> *hubGroup = nullptr;
     flat_hash_map<uint64_t, Connection*> connIdToConnection;
-    uint64_t nextConnectionId = 1;
     bool gracefulShutdown = false;
     uint64_t serverStart = ::time(nullptr);
 
@@ -255,7 +254,8 @@ void RelayServer::runWebsocket(ThreadPool<MsgWebsocket>::Thread &thr) {
     });
 
     hubGroup->onConnection([&](uWS::WebSocket<uWS::SERVER> *ws, uWS::HttpRequest req) {
-        uint64_t connId = nextConnectionId++;
+        // Encodes the owning thread, so other threads can route messages back here
+        uint64_t connId = newConnId(thr.id);
 
         Connection *c = new Connection(ws, connId);
 
@@ -270,6 +270,7 @@ void RelayServer::runWebsocket(ThreadPool<MsgWebsocket>::Thread &thr) {
 
         ws->setUserData((void*)c);
         connIdToConnection.emplace(connId, c);
+        numConnections++;
 
         bool compEnabled, compSlidingWindow;
         ws->getCompressionState(compEnabled, compSlidingWindow);
@@ -306,12 +307,13 @@ void RelayServer::runWebsocket(ThreadPool<MsgWebsocket>::Thread &thr) {
 
         connIdToConnection.erase(connId);
         delete c;
+        uint64_t remaining = --numConnections;
 
         PrometheusMetrics::getInstance().activeConnections.dec();
 
         if (gracefulShutdown) {
-            LI << "Graceful shutdown in progress: " << connIdToConnection.size() << " connections remaining";
-            if (connIdToConnection.size() == 0) {
+            LI << "Graceful shutdown in progress: " << remaining << " connections remaining";
+            if (remaining == 0) {
                 LW << "All connections closed, shutting down";
                 ::exit(0);
             }
@@ -390,29 +392,30 @@ void RelayServer::runWebsocket(ThreadPool<MsgWebsocket>::Thread &thr) {
             } else if (auto msg = std::get_if<MsgWebsocket::SendBinary>(&newMsg.msg)) {
                 doSend(msg->connId, msg->payload, uWS::OpCode::BINARY);
             } else if (auto msg = std::get_if<MsgWebsocket::SendEventToBatch>(&newMsg.msg)) {
-                tempBuf.reserve(13 + MAX_SUBID_SIZE + msg->evJson.size());
-                tempBuf.resize(10 + MAX_SUBID_SIZE);
-                tempBuf += "\",";
-                tempBuf += msg->evJson;
-                tempBuf += "]";
+                // If this is the only websocket thread sent the frame, the prefixes can be written
+                // straight into its head room. Otherwise other threads may be reading it, so work on a
+                // private copy.
+
+                std::string *buf = &msg->frame->buf;
+
+                if (!msg->exclusive) {
+                    tempBuf = msg->frame->buf;
+                    buf = &tempBuf;
+                }
 
                 for (auto &item : msg->list) {
                     PROM_INC_RELAY_MSG("EVENT");
-                    auto subIdSv = item.subId.sv();
-                    auto *p = tempBuf.data() + MAX_SUBID_SIZE - subIdSv.size();
-                    memcpy(p, "[\"EVENT\",\"", 10);
-                    memcpy(p + 10, subIdSv.data(), subIdSv.size());
-                    doSend(item.connId, std::string_view(p, 13 + subIdSv.size() + msg->evJson.size()), uWS::OpCode::TEXT);
+                    doSend(item.connId, EventFrame::render(*buf, item.subId.sv()), uWS::OpCode::TEXT);
                 }
             } else if (std::get_if<MsgWebsocket::GracefulShutdown>(&newMsg.msg)) {
-                LW << "Initiating graceful shutdown: " << connIdToConnection.size() << " connections remaining";
+                if (thr.id == 0) LW << "Initiating graceful shutdown: " << numConnections << " connections remaining";
                 gracefulShutdown = true;
                 hubGroup->stopListening();
             }
         }
     };
 
-    hubTrigger = new uS::Async(hub.getLoop());
+    auto *hubTrigger = new uS::Async(hub.getLoop());
     hubTrigger->setData(&asyncCb);
 
     hubTrigger->start([](uS::Async *a){
@@ -420,15 +423,19 @@ void RelayServer::runWebsocket(ThreadPool<MsgWebsocket>::Thread &thr) {
         (*r)();
     });
 
+    hubTriggers[thr.id] = hubTrigger;
+
 
 
     int port = cfg().relay__port;
 
     std::string bindHost = cfg().relay__bind;
 
+    // Every websocket thread has its own listening socket. With REUSE_PORT the kernel spreads new connections between them
+
     if (!hub.listen(bindHost.c_str(), port, nullptr, uS::REUSE_PORT, hubGroup)) throw herr("unable to listen on port ", port);
 
-    LI << "Started websocket server on " << bindHost << ":" << port;
+    if (thr.id == 0) LI << "Started websocket server on " << bindHost << ":" << port;
 
     hub.run();
 }
@@ -8,57 +8,111 @@ void RelayServer::runWriter(ThreadPool<MsgWriter>::Thread &thr) {
     PluginEventSifter writePolicyPlugin;
     NegentropyFilterCache neFilterCache;
 
+    // Events are verified by any verifier thread, so they can arrive out of order. Each connection's
+    // events are held back until all those before them (by the seq the ingester assigned) have
+    // arrived, so that they are written, and answered with OKs, in the order they were sent.
+
+    struct ConnOrder {
+        uint64_t nextSeq = 0;
+        uint64_t numArrived = 0;
+        bool closed = false;
+        uint64_t numEvents = 0; // once closed: how many will arrive in total
+        std::map<uint64_t, MsgWriter> held;
+    };
+
+    flat_hash_map<uint64_t, ConnOrder> connOrders;
+
+    struct Response {
+        uint64_t connId;
+        std::string eventIdHex;
+        bool written = false;
+        std::string message;
+        size_t newEventIndex = MAX_U64; // response depends on the write
+    };
+
     while(1) {
         auto newMsgs = thr.inbox.pop_all();
 
-        // Filter out messages from already closed sockets
+        // Messages from already closed sockets are dropped, but still counted, so that the
+        // connection's state can be freed once they have all arrived
 
-        {
-            flat_hash_set<uint64_t> closedConns;
+        for (auto &newMsg : newMsgs) {
+            if (auto msg = std::get_if<MsgWriter::CloseConn>(&newMsg.msg)) {
+                auto &o = connOrders[msg->connId];
+                o.closed = true;
+                o.numEvents = msg->numEvents;
+                o.held.clear();
+                if (o.numArrived == o.numEvents) connOrders.erase(msg->connId);
+            }
+        }
+
+        std::vector<MsgWriter> released;
+
+        for (auto &newMsg : newMsgs) {
+            uint64_t connId, seq;
 
-            for (auto &newMsg : newMsgs) {
-                if (auto msg = std::get_if<MsgWriter::CloseConn>(&newMsg.msg)) closedConns.insert(msg->connId);
+            if (auto msg = std::get_if<MsgWriter::AddEvent>(&newMsg.msg)) {
+                connId = msg->connId;
+                seq = msg->seq;
+            } else if (auto msg = std::get_if<MsgWriter::Rejected>(&newMsg.msg)) {
+                connId = msg->connId;
+                seq = msg->seq;
+            } else {
+                continue;
             }
 
-            if (closedConns.size()) {
-                decltype(newMsgs) newMsgsFiltered;
+            auto &o = connOrders[connId];
+            o.numArrived++;
 
-                for (auto &newMsg : newMsgs) {
-                    if (auto msg = std::get_if<MsgWriter::AddEvent>(&newMsg.msg)) {
-                        if (!closedConns.contains(msg->connId)) newMsgsFiltered.emplace_back(std::move(newMsg));
-                    }
-                }
+            if (o.closed) {
+                if (o.numArrived == o.numEvents) connOrders.erase(connId);
+                continue;
+            }
 
-                std::swap(newMsgs, newMsgsFiltered);
+            o.held.emplace(seq, std::move(newMsg));
+
+            while (o.held.size() && o.held.begin()->first == o.nextSeq) {
+                released.emplace_back(std::move(o.held.begin()->second));
+                o.held.erase(o.held.begin());
+                o.nextSeq++;
             }
         }
 
         // Prepare messages
 
         std::vector<EventToWrite> newEvents;
+        std::vector<Response> responses;
 
-        for (auto &newMsg : newMsgs) {
-            if (auto msg = std::get_if<MsgWriter::AddEvent>(&newMsg.msg)) {
+        for (auto &m : released) {
+            if (auto msg = std::get_if<MsgWriter::Rejected>(&m.msg)) {
+                responses.push_back({ msg->connId, std::move(msg->eventIdHex), false, std::move(msg->message) });
+            } else if (auto msg = std::get_if<MsgWriter::AddEvent>(&m.msg)) {
                 EventSourceType sourceType = msg->ipAddr.size() == 4 ? EventSourceType::IP4 : EventSourceType::IP6;
                 std::string okMsg;
                 const std::string &plugin = cfg().relay__writePolicy__plugin;
 
                 auto res = writePolicyPlugin.acceptEvent(plugin, plugin.empty() ? tao::json::empty_object : tao::json::from_string(msg->jsonStr), sourceType, msg->ipAddr, msg->authed, okMsg);
+                auto eventIdHex = to_hex(PackedEventView(msg->packedStr).id());
 
                 if (res == PluginEventSifterResult::Accept) {
+                    responses.push_back({ msg->connId, std::move(eventIdHex), false, "", newEvents.size() });
                     newEvents.emplace_back(std::move(msg->packedStr), std::move(msg->jsonStr), msg);
                 } else {
-                    PackedEventView packed(msg->packedStr);
-                    auto eventIdHex = to_hex(packed.id());
-
                     if (okMsg.size()) LI << "[" << msg->connId << "] write policy blocked event " << eventIdHex << ": " << okMsg;
 
-                    sendOKResponse(msg->connId, eventIdHex, res == PluginEventSifterResult::ShadowReject, okMsg);
+                    responses.push_back({ msg->connId, std::move(eventIdHex), res == PluginEventSifterResult::ShadowReject, std::move(okMsg) });
                 }
             }
         }
 
-        if (!newEvents.size()) continue;
+        auto sendResponses = [&]{
+            for (auto &r : responses) sendOKResponse(r.connId, r.eventIdHex, r.written, r.message);
+        };
+
+        if (!newEvents.size()) {
+            sendResponses();
+            continue;
+        }
 
         // Do write
 
@@ -67,43 +121,49 @@ void RelayServer::runWriter(ThreadPool<MsgWriter>::Thread &thr) {
             auto txn = env.txn_rw();
             writeEvents(txn, neFilterCache, newEvents);
             txn.commit();
+            indexStats.commit();
             auto t1 = std::chrono::steady_clock::now();
             auto us = std::chrono::duration_cast<std::chrono::microseconds>(t1 - t0).count();
             PrometheusMetrics::getInstance().writeTimeUs.inc(us);
             PrometheusMetrics::getInstance().lastWriteBatchSize.set(newEvents.size());
         } catch (std::exception &e) {
             LE << "Error writing " << newEvents.size() << " events: " << e.what();
+            indexStats.discard();
 
-            for (auto &newEvent : newEvents) {
-                PackedEventView packed(newEvent.packedStr);
-                auto eventIdHex = to_hex(packed.id());
-                MsgWriter::AddEvent *addEventMsg = static_cast<MsgWriter::AddEvent*>(newEvent.userData);
-
-                std::string message = "Write error: ";
-                message += e.what();
-
-                sendOKResponse(addEventMsg->connId, eventIdHex, false, message);
+            for (auto &r : responses) {
+                if (r.newEventIndex == MAX_U64) continue;
+                r.message = "Write error: ";
+                r.message += e.what();
             }
 
+            sendResponses();
             continue;
         }
 
+        // Notify monitors without waiting for the DB change watcher
+
+        if (std::any_of(newEvents.begin(), newEvents.end(), [](auto &e){ return e.status == EventWriteStatus::Written; })) {
+            tpReqMonitor.dispatchToAll([]{ return MsgReqMonitor{MsgReqMonitor::DBChange{}}; });
+        }
+
         // Log
 
-        for (auto &newEvent : newEvents) {
+        for (auto &r : responses) {
+            if (r.newEventIndex == MAX_U64) continue;
+
+            auto &newEvent = newEvents[r.newEventIndex];
             PackedEventView packed(newEvent.packedStr);
-            auto eventIdHex = to_hex(packed.id());
-            std::string message;
-            bool written = false;
+            auto &eventIdHex = r.eventIdHex;
+            std::string &message = r.message;
 
             if (newEvent.status == EventWriteStatus::Written) {
                 LI << "Inserted event. id=" << eventIdHex << " levId=" << newEvent.levId;
-                written = true;
+                r.written = true;
                 PrometheusMetrics::getInstance().writtenEventsTotal.inc();
                 PROM_INC_EVENT_KIND(std::to_string(packed.kind()));
             } else if (newEvent.status == EventWriteStatus::Duplicate) {
                 message = "duplicate: have this event";
-                written = true;
+                r.written = true;
                 PrometheusMetrics::getInstance().dupEventsTotal.inc();
             } else if (newEvent.status == EventWriteStatus::Replaced) {
                 message = "replaced: have newer event";
@@ -116,10 +176,8 @@ void RelayServer::runWriter(ThreadPool<MsgWriter>::Thread &thr) {
             if (newEvent.status != EventWriteStatus::Written) {
                 LI << "Rejected event. " << message << ", id=" << eventIdHex;
             }
-
-            MsgWriter::AddEvent *addEventMsg = static_cast<MsgWriter::AddEvent*>(newEvent.userData);
-
-            sendOKResponse(addEventMsg->connId, eventIdHex, written, message);
         }
+
+        sendResponses();
     }
 }
@@ -48,7 +48,13 @@ void RelayServer::run() {
         if (s != 0) throw herr("Unable to set sigmask: ", strerror(errno));
     }
 
-    tpWebsocket.init("Websocket", 1, [this](auto &thr){
+    eventIdFilter.loadInBackground();
+
+    indexStats.loadInBackground(cfg().relay__queryPlannerSampleSize);
+
+    hubTriggers.resize(cfg().relay__numThreads__websocket, nullptr);
+
+    tpWebsocket.init("Websocket", cfg().relay__numThreads__websocket, [this](auto &thr){
         runWebsocket(thr);
     });
 
@@ -56,14 +62,24 @@ void RelayServer::run() {
         runIngester(thr);
     });
 
+    tpVerifier.init("Verifier", cfg().relay__numThreads__verifier, [this](auto &thr){
+        runVerifier(thr);
+    });
+
     tpWriter.init("Writer", 1, [this](auto &thr){
         runWriter(thr);
     });
 
+    scanPool.init(cfg().relay__numThreads__scanPool, cfg().relay__parallelScanMinCursors);
+
+    reqWorkerIdle = std::vector<std::atomic<bool>>(cfg().relay__numThreads__reqWorker);
+
     tpReqWorker.init("ReqWorker", cfg().relay__numThreads__reqWorker, [this](auto &thr){
         runReqWorker(thr);
     });
 
+    newEventFeed.init(cfg().relay__numThreads__reqMonitor);
+
     tpReqMonitor.init("ReqMonitor", cfg().relay__numThreads__reqMonitor, [this](auto &thr){
         runReqMonitor(thr);
     });
@@ -1,5 +1,6 @@
 #pragma once
 
-const uint64_t CURR_DB_VERSION = 3;
+const uint64_t CURR_DB_VERSION = 6;
 const size_t MAX_SUBID_SIZE = 64; // NIP-01: REQ subscription ids must be non-empty and <=64 bytes
 const size_t MAX_INDEXED_TAG_VAL_SIZE = 255;
+const size_t EVENT_ID_INDEX_PREFIX_SIZE = 12; // bytes of event ids stored in the id index, see lookupEventById()
@@ -2,23 +2,48 @@
 
 #include "events.h"
 #include "jsonParseUtils.h"
+#include "EventCounts.h"
+#include "PubkeyIds.h"
 
 
 std::string nostrJsonToPackedEvent(const tao::json::value &v) {
-    PackedEventTagBuilder tagBuilder;
-
-    // Extract values from JSON, add strings to builder
+    // Extract values from JSON
 
-    auto id = from_hex(jsonGetString(v.at("id"), "event id field was not a string"), false);
-    auto pubkey = from_hex(jsonGetString(v.at("pubkey"), "event pubkey field was not a string"), false);
+    auto &idHex = jsonGetString(v.at("id"), "event id field was not a string");
+    auto &pubkeyHex = jsonGetString(v.at("pubkey"), "event pubkey field was not a string");
     uint64_t created_at = jsonGetUnsigned(v.at("created_at"), "event created_at field was not an integer");
     uint64_t kind = jsonGetUnsigned(v.at("kind"), "event kind field was not an integer");
 
+    jsonGetString(v.at("content"), "event content field was not a string");
+
+    auto &tagsArr = jsonGetArray(v.at("tags"), "tags field not an array");
+    if (tagsArr.size() > cfg().events__maxNumTags) throw herr("too many tags: ", tagsArr.size());
+
+    std::vector<NostrTagRef> tags;
+    tags.reserve(tagsArr.size());
+
+    for (auto &tagArr : tagsArr) {
+        auto &tag = jsonGetArray(tagArr, "tag in tags field was not an array");
+        if (tag.size() < 1) throw herr("too few fields in tag");
+
+        std::string_view tagName = jsonGetString(tag.at(0), "tag name was not a string");
+        std::string_view tagVal = tag.size() >= 2 ? std::string_view(jsonGetString(tag.at(1), "tag val was not a string")) : std::string_view("");
+
+        tags.emplace_back(tagName, tagVal);
+    }
+
+    return nostrFieldsToPackedEvent(idHex, pubkeyHex, created_at, kind, tags);
+}
+
+std::string nostrFieldsToPackedEvent(std::string_view idHex, std::string_view pubkeyHex, uint64_t created_at, uint64_t kind, const std::vector<NostrTagRef> &tags) {
+    PackedEventTagBuilder tagBuilder;
+
+    auto id = from_hex(idHex, false);
+    auto pubkey = from_hex(pubkeyHex, false);
+
     if (id.size() != 32) throw herr("unexpected id size");
     if (pubkey.size() != 32) throw herr("unexpected pubkey size");
 
-    jsonGetString(v.at("content"), "event content field was not a string");
-
     uint64_t expiration = 0;
 
     if (isReplaceableKind(kind)) {
@@ -26,20 +51,21 @@ std::string nostrJsonToPackedEvent(const tao::json::value &v) {
         tagBuilder.add('d', "");
     }
 
-    if (jsonGetArray(v.at("tags"), "tags field not an array").size() > cfg().events__maxNumTags) throw herr("too many tags: ", v.at("tags").get_array().size());
-    for (auto &tagArr : v.at("tags").get_array()) {
-        auto &tag = jsonGetArray(tagArr, "tag in tags field was not an array");
-        if (tag.size() < 1) throw herr("too few fields in tag");
+    if (tags.size() > cfg().events__maxNumTags) throw herr("too many tags: ", tags.size());
+
+    std::string decodedTagVal;
 
-        auto tagName = jsonGetString(tag.at(0), "tag name was not a string");
-        auto tagVal = tag.size() >= 2 ? jsonGetString(tag.at(1), "tag val was not a string") : "";
+    for (const auto &tag : tags) {
+        std::string_view tagName = tag.name;
+        std::string_view tagVal = tag.val;
 
         if (tagName.size() == 1) {
             if (tagVal.size() > cfg().events__maxTagValSize) throw herr("tag val too large: ", tagVal.size());
 
             if (tagName == "e" || tagName == "p") {
                 if (tagVal.size() != 64) throw herr("unexpected size for fixed-size tag: ", tagName);
-                tagVal = from_hex(tagVal, false);
+                decodedTagVal = from_hex(tagVal, false);
+                tagVal = decodedTagVal;
             } else if (tagName == "a" && kind == 5) {
                 auto [tagKind, tagPubkey, tagDTag] = parseATag(tagVal);
                 if (tagPubkey != pubkey) throw herr("can't delete other user's events");
@@ -50,7 +76,7 @@ std::string nostrJsonToPackedEvent(const tao::json::value &v) {
             }
         } else if (tagName == "expiration") {
             if (expiration == 0) {
-                expiration = parseUint64(tagVal);
+                expiration = parseUint64(std::string(tagVal));
                 if (expiration < 100) throw herr("invalid expiration");
             }
         }
@@ -162,12 +188,25 @@ void parseAndVerifyEvent(const tao::json::value &origJson, secp256k1_context *se
 
 
 
+EventIdFilter eventIdFilter;
+IndexStats indexStats;
+
+// The id index only stores a prefix of each id, so the events found must be checked. Almost always
+// there is at most one
 std::optional<defaultDb::environment::View_Event> lookupEventById(lmdb::txn &txn, std::string_view id) {
     std::optional<defaultDb::environment::View_Event> output;
+    std::string_view prefix = id.substr(0, EVENT_ID_INDEX_PREFIX_SIZE);
 
-    env.generic_foreachFull(txn, env.dbi_Event__id, makeKey_StringUint64(id, 0), lmdb::to_sv<uint64_t>(0), [&](auto k, auto v) {
-        if (k.starts_with(id)) output = env.lookup_Event(txn, lmdb::from_sv<uint64_t>(v));
-        return false;
+    env.generic_foreachFull(txn, env.dbi_Event__id, makeKey_StringUint64(prefix, 0), lmdb::to_sv<uint64_t>(0), [&](auto k, auto v) {
+        if (k.size() != prefix.size() + 8 || !k.starts_with(prefix)) return false;
+
+        auto ev = env.lookup_Event(txn, lmdb::from_sv<uint64_t>(v));
+        if (ev && PackedEventView(ev->buf).id() == id) {
+            output = ev;
+            return false;
+        }
+
+        return true;
     });
 
     return output;
@@ -231,12 +270,48 @@ std::string_view getEventJson(lmdb::txn &txn, Decompressor &decomp, uint64_t lev
     return decodeEventPayload(txn, decomp, eventPayload, nullptr, nullptr);
 }
 
+// Whether the stored event is the one with this packed event and sig. The caller must have checked that
+// the event's id is the hash of its fields, so that these determine the whole event. Returns false if this
+// can't be told without decompressing the stored payload.
+
+bool storedEventMatches(lmdb::txn &txn, const defaultDb::environment::View_Event &existing, std::string_view packedStr, std::string_view sig) {
+    if (existing.buf != packedStr) return false;
+
+    std::string_view eventPayload;
+    if (!env.dbi_EventPayload.get(txn, lmdb::to_sv<uint64_t>(existing.primaryKeyId), eventPayload)) return false;
+    if (eventPayload.size() == 0 || eventPayload[0] != '\x00') return false;
+
+    // Quotes inside content and tags are escaped, so this can only be the top-level key
+    static const std::string_view sigKey = ",\"sig\":\"";
+    auto pos = eventPayload.find(sigKey);
+    if (pos == std::string_view::npos || eventPayload.size() < pos + sigKey.size() + 128) return false;
+
+    try {
+        return from_hex(eventPayload.substr(pos + sigKey.size(), 128), false) == sig;
+    } catch (...) {
+        return false;
+    }
+}
+
 
 
 
 // Do not use externally: does not handle negentropy trees
 
 bool deleteEventBasic(lmdb::txn &txn, uint64_t levId) {
+    PubkeyIds::Scope pubkeyIdsScope(txn);
+    auto counts = EventCounts::maintained(txn);
+
+    if (eventIdFilter.isLoaded() || indexStats.isLoaded() || counts) {
+        auto ev = env.lookup_Event(txn, levId);
+        if (ev) {
+            PackedEventView packed(ev->buf);
+            eventIdFilter.remove(packed.id());
+            indexStats.remove(packed);
+            if (counts) EventCounts::remove(txn, *counts, levId, packed);
+        }
+    }
+
     bool deleted = env.dbi_EventPayload.del(txn, lmdb::to_sv<uint64_t>(levId));
     env.delete_Event(txn, levId);
     return deleted;
@@ -257,8 +332,12 @@ void writeEvents(lmdb::txn &txn, NegentropyFilterCache &neFilterCache, std::vect
         return aC < bC;
     });
 
+    eventIdFilter.growIfNeeded();
+
     std::vector<uint64_t> levIdsToDelete;
     std::string tmpBuf;
+    auto counts = EventCounts::maintained(txn);
+    PubkeyIds::Scope pubkeyIdsScope(txn);
 
     neFilterCache.ctx(txn, [&](const std::function<void(const PackedEventView &, bool)> &updateNegentropy){
         for (size_t i = 0; i < evs.size(); i++) {
@@ -402,6 +481,9 @@ void writeEvents(lmdb::txn &txn, NegentropyFilterCache &neFilterCache, std::vect
 
             if (ev.status == EventWriteStatus::Pending) {
                 ev.levId = env.insert_Event(txn, ev.packedStr);
+                eventIdFilter.insert(packed.id());
+                indexStats.add(packed);
+                if (counts) EventCounts::add(txn, *counts, ev.levId, packed);
 
                 tmpBuf.clear();
                 tmpBuf += '\x00';
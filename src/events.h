@@ -9,10 +9,20 @@
 #include "NegentropyFilterCache.h"
 #include "Decompressor.h"
 #include "EventUtils.h"
+#include "EventIdFilter.h"
+#include "IndexStats.h"
 
 
 
+struct NostrTagRef {
+    std::string_view name;
+    std::string_view val; // empty if tag has only a name
+
+    NostrTagRef(std::string_view name, std::string_view val) : name(name), val(val) {}
+};
+
 std::string nostrJsonToPackedEvent(const tao::json::value &v);
+std::string nostrFieldsToPackedEvent(std::string_view idHex, std::string_view pubkeyHex, uint64_t created_at, uint64_t kind, const std::vector<NostrTagRef> &tags);
 Bytes32 nostrHash(const tao::json::value &origJson);
 
 bool verifySig(secp256k1_context* ctx, std::string_view sig, std::string_view hash, std::string_view pubkey);
@@ -24,12 +34,16 @@ void parseAndVerifyEvent(const tao::json::value &origJson, secp256k1_context *se
 
 
 
+extern EventIdFilter eventIdFilter; // maintained by writeEvents()/deleteEventBasic()
+extern IndexStats indexStats; // ditto
+
 std::optional<defaultDb::environment::View_Event> lookupEventById(lmdb::txn &txn, std::string_view id);
 defaultDb::environment::View_Event lookupEventByLevId(lmdb::txn &txn, uint64_t levId); // throws if can't find
 uint64_t getMostRecentLevId(lmdb::txn &txn);
 std::string_view decodeEventPayload(lmdb::txn &txn, Decompressor &decomp, std::string_view raw, uint32_t *outDictId, size_t *outCompressedSize);
 std::string_view getEventJson(lmdb::txn &txn, Decompressor &decomp, uint64_t levId);
 std::string_view getEventJson(lmdb::txn &txn, Decompressor &decomp, uint64_t levId, std::string_view eventPayload);
+bool storedEventMatches(lmdb::txn &txn, const defaultDb::environment::View_Event &existing, std::string_view packedStr, std::string_view sig);
 
 
 
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <bitset>
+
 #include "config.h"
 #include "global.h"
 #include "golpe.h"
@@ -16,6 +18,7 @@ struct FilterSetBytes : NonCopyable {
 
     std::vector<Item> items;
     std::string buf;
+    flat_hash_set<uint64_t> fingerprints; // hashes of the items, only for large sets
 
     // Sizes are post-hex decode 
 
@@ -41,6 +44,10 @@ struct FilterSetBytes : NonCopyable {
         }
 
         if (buf.size() > 65535) throw herr("total filter items too large");
+
+        if (items.size() >= MinFingerprintSize) {
+            for (size_t i = 0; i < items.size(); i++) fingerprints.insert(fingerprint(itemView(i)));
+        }
     }
 
     std::string at(size_t n) const {
@@ -53,7 +60,27 @@ struct FilterSetBytes : NonCopyable {
         return items.size();
     }
 
+    void appendCanonical(std::string &out) const {
+        out += lmdb::to_sv<uint64_t>(items.size());
+        for (const auto &item : items) {
+            out += (char)item.size;
+            out += std::string_view(buf.data() + item.offset, item.size);
+        }
+    }
+
+    // Small sets are compared in a linear pass. Large sets first check the candidate's fingerprint,
+    // so that most non-members (the usual case) are rejected with one hash lookup, and only members
+    // and fingerprint collisions fall through to the binary search.
     bool doesMatch(std::string_view candidate) const {
+        if (items.size() <= MaxLinearSize) {
+            for (size_t i = 0; i < items.size(); i++) {
+                if (candidate == itemView(i)) return true;
+            }
+            return false;
+        }
+
+        if (fingerprints.size() && !fingerprints.contains(fingerprint(candidate))) return false;
+
         // Binary search for upper-bound: https://en.cppreference.com/w/cpp/algorithm/upper_bound
 
         ssize_t first = 0, last = items.size(), curr;
@@ -81,6 +108,18 @@ struct FilterSetBytes : NonCopyable {
 
         return false;
     }
+
+  private:
+    static constexpr size_t MaxLinearSize = 8;
+    static constexpr size_t MinFingerprintSize = 64;
+
+    std::string_view itemView(size_t n) const {
+        return std::string_view(buf.data() + items[n].offset, items[n].size);
+    }
+
+    static uint64_t fingerprint(std::string_view s) {
+        return std::hash<std::string_view>{}(s);
+    }
 };
 
 struct FilterSetUint : NonCopyable {
@@ -115,16 +154,14 @@ struct NostrFilter : NonCopyable {
     std::optional<FilterSetBytes> authors;
     std::optional<FilterSetUint> kinds;
     flat_hash_map<char, FilterSetBytes> tags;
+    std::bitset<256> tagNames; // the keys of tags, so that doesMatch() can skip other tags without a lookup
 
     uint64_t since = 0;
     uint64_t until = MAX_U64;
     uint64_t limit = MAX_U64;
     bool neverMatch = false;
-    bool indexOnlyScans = false;
 
     explicit NostrFilter(const tao::json::value &filterObj, uint64_t maxFilterLimit) {
-        uint64_t numMajorFields = 0;
-
         if (!filterObj.is_object()) throw herr("provided filter is not an object");
 
         for (const auto &[k, v] : filterObj.get_object()) {
@@ -138,8 +175,6 @@ struct NostrFilter : NonCopyable {
                     neverMatch = true;
                     continue;
                 }
-                numMajorFields++;
-
                 try {
                     ids.emplace(v, true, 32, 32);
                 } catch (std::exception &e) {
@@ -151,8 +186,6 @@ struct NostrFilter : NonCopyable {
                     neverMatch = true;
                     continue;
                 }
-                numMajorFields++;
-
                 try {
                     authors.emplace(v, true, 32, 32);
                 } catch (std::exception &e) {
@@ -164,8 +197,6 @@ struct NostrFilter : NonCopyable {
                     neverMatch = true;
                     continue;
                 }
-                numMajorFields++;
-
                 try {
                     kinds.emplace(v);
                 } catch (std::exception &e) {
@@ -177,8 +208,6 @@ struct NostrFilter : NonCopyable {
                     neverMatch = true;
                     continue;
                 }
-                numMajorFields++;
-
                 try {
                     if (k.size() == 2) {
                         char tag = k[1];
@@ -205,11 +234,11 @@ struct NostrFilter : NonCopyable {
             }
         }
 
-        if (tags.size() > cfg().relay__maxTagsPerFilter) throw herr("too many tags in filter"); // O(N^2) in matching, so prevent it from being too large
+        if (tags.size() > cfg().relay__maxTagsPerFilter) throw herr("too many tags in filter");
 
-        if (limit > maxFilterLimit) limit = maxFilterLimit;
+        for (const auto &[tagName, _] : tags) tagNames.set(uint8_t(tagName));
 
-        indexOnlyScans = (numMajorFields <= 1) || (numMajorFields == 2 && authors && kinds);
+        if (limit > maxFilterLimit) limit = maxFilterLimit;
     }
 
     bool doesMatchTimes(uint64_t created) const {
@@ -223,22 +252,26 @@ struct NostrFilter : NonCopyable {
 
         if (!doesMatchTimes(ev.created_at())) return false;
 
+        if (kinds && !kinds->doesMatch(ev.kind())) return false;
         if (ids && !ids->doesMatch(ev.id())) return false;
         if (authors && !authors->doesMatch(ev.pubkey())) return false;
-        if (kinds && !kinds->doesMatch(ev.kind())) return false;
 
-        for (const auto &[tag, filt] : tags) {
-            bool foundMatch = false;
+        if (tags.size()) {
+            // Every tag filter must be satisfied: check them all in a single pass over the event's tags,
+            // crossing off each tag name once one of its values is found
+
+            auto pending = tagNames;
+            size_t numPending = tags.size();
 
             ev.foreachTag([&](char tagName, std::string_view tagVal){
-                if (tagName == tag && filt.doesMatch(tagVal)) {
-                    foundMatch = true;
-                    return false;
-                }
-                return true;
+                if (!pending.test(uint8_t(tagName))) return true;
+                if (!tags.find(tagName)->second.doesMatch(tagVal)) return true;
+
+                pending.reset(uint8_t(tagName));
+                return --numPending > 0;
             });
 
-            if (!foundMatch) return false;
+            if (numPending) return false;
         }
 
         return true;
@@ -247,6 +280,32 @@ struct NostrFilter : NonCopyable {
     bool isFullDbQuery() {
         return !ids && !authors && !kinds && tags.size() == 0;
     }
+
+    // Filters that match the same events (in the same order, with the same limit) have identical canonical forms
+    void appendCanonical(std::string &out) const {
+        if (ids) { out += 'i'; ids->appendCanonical(out); }
+        if (authors) { out += 'a'; authors->appendCanonical(out); }
+
+        if (kinds) {
+            out += 'k';
+            out += lmdb::to_sv<uint64_t>(kinds->size());
+            for (auto k : kinds->items) out += lmdb::to_sv<uint64_t>(k);
+        }
+
+        std::vector<char> tagNames;
+        for (const auto &[tagName, _] : tags) tagNames.push_back(tagName);
+        std::sort(tagNames.begin(), tagNames.end());
+
+        for (char tagName : tagNames) {
+            out += '#';
+            out += tagName;
+            tags.at(tagName).appendCanonical(out);
+        }
+
+        out += 's'; out += lmdb::to_sv<uint64_t>(since);
+        out += 'u'; out += lmdb::to_sv<uint64_t>(until);
+        out += 'l'; out += lmdb::to_sv<uint64_t>(limit);
+    }
 };
 
 struct NostrFilterGroup : NonCopyable {
@@ -301,6 +360,15 @@ struct NostrFilterGroup : NonCopyable {
     bool isFullDbQuery() {
         return size() == 1 && filters[0].isFullDbQuery();
     }
+
+    std::string canonical() const {
+        std::string out;
+        for (const auto &f : filters) {
+            f.appendCanonical(out);
+            out += '|';
+        }
+        return out;
+    }
 };
 
 struct FilterValidator : NonCopyable {
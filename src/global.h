@@ -21,3 +21,4 @@ void exitOnSigPipe();
 void parseCommaSeparatedKinds(std::string_view str, flat_hash_set<uint64_t> &out); 
 
 extern lmdb::dbi negentropyDbi;
+extern bool tagKindIndexed;
@@ -47,7 +47,8 @@ void onPreStartup(int argc, char **argv) {
 static void dbCheck(lmdb::txn &txn, const std::string &cmd) {
     auto dbTooOld = [&](uint64_t ver) {
         LE << "Database version too old: " << ver << ". Expected version " << CURR_DB_VERSION;
-        LE << "You should 'strfry export' your events, delete (or move) the DB files, and 'strfry import' them";
+        if (ver >= 3) LE << "You should run 'strfry migrate' to upgrade it in place";
+        else LE << "You should 'strfry export' your events, delete (or move) the DB files, and 'strfry import' them";
         throw herr("aborting: DB too old");
     };
 
@@ -60,7 +61,7 @@ static void dbCheck(lmdb::txn &txn, const std::string &cmd) {
     auto s = env.lookup_Meta(txn, 1);
 
     if (!s) {
-        env.insert_Meta(txn, CURR_DB_VERSION, 1, 1);
+        env.insert_Meta(txn, CURR_DB_VERSION, 1, 1, cfg().events__indexTagKind ? 0 : 1);
         env.insert_NegentropyFilter(txn, "{}");
         return;
     }
@@ -69,6 +70,7 @@ static void dbCheck(lmdb::txn &txn, const std::string &cmd) {
 
     if (s->dbVersion() < CURR_DB_VERSION) {
         if (cmd == "export" || cmd == "info") return;
+        if (cmd == "migrate" && s->dbVersion() >= 3) return;
         dbTooOld(s->dbVersion());
     }
 
@@ -77,6 +79,29 @@ static void dbCheck(lmdb::txn &txn, const std::string &cmd) {
     }
 }
 
+// Whether the Event__tagKind index is complete, and so is written to and used by queries. Turning
+// events.indexTagKind off drops it right away, but turning it back on needs 'strfry migrate' to rebuild
+// it: until then it stays unused.
+static void tagKindIndexCheck(lmdb::txn &txn) {
+    auto m = env.lookup_Meta(txn, 1);
+    if (!m || m->dbVersion() != CURR_DB_VERSION) return;
+
+    bool built = m->noTagKindIndex() == 0;
+
+    if (!cfg().events__indexTagKind) {
+        if (built) {
+            LI << "events.indexTagKind is off: dropping the tag+kind index";
+            lmdb::dbi_drop(txn, env.dbi_Event__tagKind);
+            env.update_Meta(txn, *m, { .noTagKindIndex = 1 });
+        }
+        return;
+    }
+
+    if (!built) LW << "events.indexTagKind is on but the tag+kind index hasn't been built: run 'strfry migrate' to build it";
+
+    tagKindIndexed = built;
+}
+
 static void setRLimits() {
     if (!cfg().relay__nofiles) return;
     struct rlimit curr;
@@ -105,9 +130,11 @@ static void setRLimits() {
 
 
 lmdb::dbi negentropyDbi;
+bool tagKindIndexed = false;
 
 void onAppStartup(lmdb::txn &txn, const std::string &cmd) {
     dbCheck(txn, cmd);
+    tagKindIndexCheck(txn);
 
     setRLimits();
 
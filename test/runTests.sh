@@ -25,10 +25,28 @@ node "./test/tests/readRestrictTest.js" \
   && pass "./test/tests/readRestrictTest.js" \
   || fail "./test/tests/readRestrictTest.js failed"
 
+info "running query cache tests..."
+
+node "./test/tests/queryCacheTest.js" \
+  && pass "./test/tests/queryCacheTest.js" \
+  || fail "./test/tests/queryCacheTest.js failed"
+
 info "Seeding events..."
 
 perl "./test/utils/generate-seed-data.pl" -o - | ./strfry --config ./test/cfgs/test.conf import --no-verify
 
+info "running event parser differential test..."
+
+./strfry --config ./test/cfgs/test.conf bench parse --events=10000 --repeat=1 \
+  && pass "strfry bench parse" \
+  || fail "strfry bench parse failed"
+
+info "running migrate test..."
+
+perl "./test/tests/migrateTest.pl" \
+  && pass "./test/tests/migrateTest.pl" \
+  || fail "./test/tests/migrateTest.pl failed"
+
 info "running filterFuzzTest..."
 
 perl "./test/tests/filterFuzzTest.pl" scan \
@@ -39,6 +57,10 @@ perl "./test/tests/filterFuzzTest.pl" scan-limit \
 && pass "./test/tests/filterFuzzTest.pl scan-limit" \
 || fail "./test/tests/filterFuzzTest.pl scan-limit failed"
 
+perl "./test/tests/filterFuzzTest.pl" scan-plans \
+&& pass "./test/tests/filterFuzzTest.pl scan-plans" \
+|| fail "./test/tests/filterFuzzTest.pl scan-plans failed"
+
 perl "./test/tests/filterFuzzTest.pl" monitor \
 && pass "./test/tests/filterFuzzTest.pl monitor" \
 || fail "./test/tests/filterFuzzTest.pl monitor failed"
@@ -102,6 +102,47 @@ sub genRandomFilterGroup {
     return \@filters;
 }
 
+# Single filters combining a tag with authors or kinds, so that the intersection and tag+kind plans apply
+
+sub genRandomIntersectFilterGroup {
+    my $f = {};
+
+    if (rand() < .5) {
+        $f->{authors} = [];
+        for (1..(rand()*3)+1) {
+            push @{$f->{authors}}, $pubkeys->[int(rand() * @$pubkeys)];
+        }
+
+        $f->{'#p'} = [];
+        for (1..(rand()*3)+1) {
+            push @{$f->{'#p'}}, $pubkeys->[int(rand() * @$pubkeys)];
+        }
+    } else {
+        $f->{kinds} = [];
+        for (1..(rand()*3)+1) {
+            push @{$f->{kinds}}, 0+$kinds->[int(rand() * @$kinds)];
+        }
+
+        if (rand() < .5) {
+            $f->{'#e'} = [];
+            for (1..(rand()*5)+1) {
+                push @{$f->{'#e'}}, $ids->[int(rand() * @$ids)];
+            }
+        } else {
+            $f->{'#t'} = [];
+            for (1..(rand()*3)+1) {
+                push @{$f->{'#t'}}, $topics->[int(rand() * @$topics)];
+            }
+        }
+    }
+
+    if (rand() < .2) {
+        $f->{since} = 1640300802 + int(rand() * 86400*365);
+    }
+
+    return [$f];
+}
+
 sub genRandomMonitorCmds {
     my $nextConnId = 1;
     my @out;
@@ -129,6 +170,7 @@ sub genRandomMonitorCmds {
 
 sub testScan {
     my $fg = shift;
+    my $scanArgs = shift // '';
     my $fge = encode_json($fg);
 
     #print JSON::XS->new->pretty(1)->encode($fg);
@@ -137,7 +179,7 @@ sub testScan {
     my $headCmd = @$fg == 1 && $fg->[0]->{limit} ? "| head -n $fg->[0]->{limit}" : "";
 
     my $resA = `./strfry export --reverse 2>/dev/null | perl test/utils/dumbFilter.pl '$fge' $headCmd | jq -r .id | sort | sha256sum`;
-    my $resB = `./strfry scan --pause 1 --metrics '$fge' | jq -r .id | sort | sha256sum`;
+    my $resB = `./strfry scan --pause 1 --metrics $scanArgs '$fge' | jq -r .id | sort | sha256sum`;
 
     print "$resA\n$resB\n";
 
@@ -204,6 +246,16 @@ if ($cmd eq 'scan') {
         my $fg = genRandomFilterGroup(1);
         testScan($fg);
     }
+} elsif ($cmd eq 'scan-plans') {
+    # Each plan that applies is forced in turn, and paused as often as possible, so that every
+    # access path has to resume correctly. Plans that don't apply fall back to the cheapest one
+    for (1..100) {
+        my $fg = rand() < .5 ? genRandomIntersectFilterGroup() : genRandomFilterGroup();
+        testScan($fg, '--index-stats');
+        for my $plan (qw{Tag PubkeyTag KindTag TagKind PubkeyKind Pubkey Kind CreatedAt}) {
+            testScan($fg, "--plan $plan");
+        }
+    }
 } elsif ($cmd eq 'monitor') {
     for (1..100) {
         my ($monCmds, $interestFg) = genRandomMonitorCmds();
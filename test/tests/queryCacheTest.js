@@ -0,0 +1,181 @@
+import os from "node:os";
+import path from "node:path";
+import {
+  writeConfig,
+  addEvent,
+  runStrfry,
+  runRelaySuite,
+  config,
+} from "../utils/relay.js";
+
+const workDir = path.join(os.tmpdir(), "strfry-tests");
+const relayDbDir = path.join(workDir, "cache-db");
+const relayCfgPath = path.join(workDir, "queryCacheRelay.conf");
+const relayPort = 40557;
+
+const pass = (msg) => console.log(`Pass: ${msg}`);
+
+// Every event added by these tests, to compute the expected responses by brute force
+const stored = [];
+
+function add(evInput) {
+  const ev = addEvent(relayCfgPath, evInput);
+  stored.push(ev);
+  return ev;
+}
+
+function expectedIds(filter) {
+  let matches = stored.filter(
+    (ev) =>
+      (!filter.kinds || filter.kinds.includes(ev.kind)) &&
+      (!filter["#t"] ||
+        ev.tags.some((t) => t[0] === "t" && filter["#t"].includes(t[1]))) &&
+      (!filter.since || ev.created_at >= filter.since),
+  );
+
+  matches.sort(
+    (a, b) => b.created_at - a.created_at || (a.id < b.id ? 1 : -1),
+  );
+  if (filter.limit !== undefined) matches = matches.slice(0, filter.limit);
+
+  return matches.map((ev) => ev.id).sort();
+}
+
+async function metric(name) {
+  const res = await fetch(`http://127.0.0.1:${relayPort}/metrics`);
+  const body = await res.text();
+  const m = body.match(new RegExp(`^${name} (\\d+)$`, "m"));
+  if (!m) throw new Error(`metric ${name} not found`);
+  return Number(m[1]);
+}
+
+let nextSubId = 0;
+
+async function req(client, filter) {
+  const subId = `cache-${nextSubId++}`;
+  client.send(["REQ", subId, filter]);
+  const msgs = await client.collectUntil(
+    (m) => m[0] === "EOSE" && m[1] === subId,
+    4_000,
+  );
+  client.send(["CLOSE", subId]);
+
+  return msgs
+    .filter((m) => m[0] === "EVENT" && m[1] === subId)
+    .map((m) => m[2].id)
+    .sort();
+}
+
+// Runs filter, and checks the response against the brute-force one, and whether it was a cache hit
+async function check(client, filter, { hit }, msg) {
+  const hitsBefore = await metric("strfry_query_cache_hits_total");
+  const got = await req(client, filter);
+  const hitsAfter = await metric("strfry_query_cache_hits_total");
+
+  expect(
+    JSON.stringify(got) === JSON.stringify(expectedIds(filter)),
+    `${msg}: response doesn't match brute force (got ${got.length} events)`,
+  );
+  expect(
+    (hitsAfter > hitsBefore) === hit,
+    `${msg}: expected cache ${hit ? "hit" : "miss"}`,
+  );
+}
+
+async function testCacheHits({ client }) {
+  for (let i = 0; i < 20; i++) {
+    add({ kind: 1, from: i % 3, tags: [["t", i % 2 ? "cache-a" : "cache-b"]] });
+  }
+
+  const filters = [
+    { kinds: [1], "#t": ["cache-a"] },
+    { kinds: [1], "#t": ["cache-a", "cache-b"], limit: 7 },
+    { "#t": ["cache-b"], limit: 3 },
+  ];
+
+  for (const f of filters) {
+    await check(client, f, { hit: false }, `first ${JSON.stringify(f)}`);
+    await check(client, f, { hit: true }, `repeat ${JSON.stringify(f)}`);
+  }
+
+  // Same filter, written differently
+  await check(
+    client,
+    { "#t": ["cache-a"], kinds: [1] },
+    { hit: true },
+    "reordered filter",
+  );
+
+  pass("testCacheHits");
+}
+
+async function testCacheTopUp({ client }) {
+  // Stored after the entries were cached, so they must be merged in
+  for (let i = 0; i < 5; i++) {
+    add({ kind: 1, from: i % 3, tags: [["t", "cache-a"], ["t", "cache-b"]] });
+  }
+  add({ kind: 7, from: 0, tags: [["t", "cache-a"]] });
+
+  await check(client, { kinds: [1], "#t": ["cache-a"] }, { hit: true }, "top-up");
+  await check(
+    client,
+    { kinds: [1], "#t": ["cache-a", "cache-b"], limit: 7 },
+    { hit: true },
+    "top-up with limit",
+  );
+
+  pass("testCacheTopUp");
+}
+
+async function testCacheDeletion({ client }) {
+  const filter = { "#t": ["cache-b"], limit: 3 };
+  const victim = expectedIds(filter)[0];
+
+  const res = runStrfry([
+    "--config",
+    relayCfgPath,
+    "delete",
+    `--filter=${JSON.stringify({ ids: [victim] })}`,
+  ]);
+  expect(res.status === 0, `delete failed: ${res.stderr}`);
+  stored.splice(stored.findIndex((ev) => ev.id === victim), 1);
+
+  // The event replacing it is unknown to the cache entry, so this has to be scanned again
+  await check(client, filter, { hit: false }, "after deletion");
+  await check(client, filter, { hit: true }, "repeat after deletion");
+
+  pass("testCacheDeletion");
+}
+
+function expect(cond, msg) {
+  if (!cond) throw new Error(msg);
+}
+
+async function main() {
+  console.log("* query result cache relay integration tests");
+
+  writeConfig(
+    config(relayDbDir, relayPort).replace(
+      "relay {",
+      "relay {\n  queryCacheBytes = 10000000",
+    ),
+    relayCfgPath,
+  );
+
+  await runRelaySuite({
+    relayConfigPath: relayCfgPath,
+    relayPort: relayPort,
+    relayDbPath: relayDbDir,
+    tests: async ({ wsUrl, client }) => {
+      await testCacheHits({ client });
+      await testCacheTopUp({ client });
+      await testCacheDeletion({ client });
+    },
+  });
+  console.log("All query cache tests passed!");
+}
+
+main().catch((err) => {
+  console.error(err && err.stack ? err.stack : String(err));
+  process.exit(1);
+});